@@ -84,6 +84,46 @@ uart_config(uint8 uart_no)
     SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA);
 }
 
+/******************************************************************************
+ * FunctionName : uart0_set_flow_ctrl
+ * Description  : Select flow control of UART0
+ *                NONE_CTRL: CTS is ignored, RTS is driven by rx fifo level
+ *                (configuration set by uart_config).
+ *                HARDWARE_CTRL: TX is paused while CTS is inactive, RTS is
+ *                driven by software with uart0_set_rts().
+ * Parameters   : UartFlowCtrl mode - NONE_CTRL or HARDWARE_CTRL
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_flow_ctrl(UartFlowCtrl mode)
+{
+    if (mode == HARDWARE_CTRL) {
+        CLEAR_PERI_REG_MASK(UART_CONF1(UART0), UART_RX_FLOW_EN);
+        SET_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+    } else {
+        CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+        SET_PERI_REG_MASK(UART_CONF1(UART0), UART_RX_FLOW_EN);
+    }
+    UartDev.flow_ctrl = mode;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_set_tx_empty_threshold
+ * Description  : Set level of UART0 tx fifo below which tx fifo empty
+ *                interrupt is raised
+ * Parameters   : uint8 threshold - number of bytes, 0..127
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_tx_empty_threshold(uint8 threshold)
+{
+    uint32 conf = READ_PERI_REG(UART_CONF1(UART0));
+
+    conf &= ~(UART_TXFIFO_EMPTY_THRHD << UART_TXFIFO_EMPTY_THRHD_S);
+    conf |= (threshold & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S;
+    WRITE_PERI_REG(UART_CONF1(UART0), conf);
+}
+
 /******************************************************************************
  * FunctionName : uart_tx_one_char
  * Description  : Internal used function
@@ -98,6 +98,8 @@ void uart0_putc(const char c);
 void uart0_tx_buffer(uint8 *buf, uint16 len);
 void uart_setup(uint8 uart_no);
 STATUS uart_tx_one_char(uint8 uart, uint8 TxChar);
+void uart0_set_flow_ctrl(UartFlowCtrl mode);
+void uart0_set_tx_empty_threshold(uint8 threshold);
 
 static void uart0_rx_intr_enable()
 {
@@ -120,4 +122,14 @@ static void uart0_tx_intr_disable()
 {
     CLEAR_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
 }
+
+/* Software RTS, used when hardware flow control is enabled with
+   uart0_set_flow_ctrl(HARDWARE_CTRL). ready == true asserts RTS. */
+static void uart0_set_rts(bool ready)
+{
+    if (ready)
+        SET_PERI_REG_MASK(UART_CONF0(0), UART_SW_RTS);
+    else
+        CLEAR_PERI_REG_MASK(UART_CONF0(0), UART_SW_RTS);
+}
 #endif
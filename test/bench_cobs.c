@@ -0,0 +1,129 @@
+/* Throughput of COBS + crc16 kernels, run with `make bench-host`.
+   Old kernels walk the frame twice (crc16_block() and byte-at-a-time
+   cobs_encode() / state machine decoder), new ones are the fused
+   cobs_encoder_put_crc() and run-copying cobs_decoder_put(). Old encode
+   includes the copy old transmitter made to append crc. Output of old
+   and new kernels is compared before timing. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "cobs.h"
+#include "crc16.h"
+#include "cobs_ref.h"
+
+#define MAX_FRAME 1600
+#define ENC_SIZE 4096
+#define ROUNDS_BYTES (64 << 20) /* payload bytes per measurement */
+
+struct sink {
+	uint8_t *data;
+	size_t len;
+	size_t frames;
+};
+
+static void sink_cb(void *arg, uint8_t *data, size_t len)
+{
+	struct sink *s = arg;
+	s->data = data;
+	s->len = len;
+	s->frames++;
+}
+
+static size_t encode_old(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	static uint8_t tmp[MAX_FRAME + 2];
+	uint16_t crc;
+
+	memcpy(tmp, src, len);
+	crc = crc16_block(tmp, len);
+	tmp[len] = crc & 0xff;
+	tmp[len + 1] = crc >> 8;
+	return cobs_encode(dst, tmp, len + 2);
+}
+
+static size_t encode_new(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	struct cobs_encoder enc;
+	uint16_t crc = CRC16_INIT_VALUE;
+	uint8_t crc_buf[2];
+
+	cobs_encoder_init(&enc, dst, ENC_SIZE - 1, 0);
+	cobs_encoder_put_crc(&enc, src, len, &crc);
+	crc_buf[0] = crc & 0xff;
+	crc_buf[1] = crc >> 8;
+	cobs_encoder_put(&enc, crc_buf, sizeof(crc_buf));
+	return cobs_encoder_finish(&enc);
+}
+
+static void bench(size_t len)
+{
+	static uint8_t data[MAX_FRAME], enc_old[ENC_SIZE], enc_new[ENC_SIZE];
+	static uint8_t dec_buf_old[MAX_FRAME + 2], dec_buf_new[MAX_FRAME + 2];
+	struct sink sink_old = { 0 }, sink_new = { 0 };
+	struct cobs_ref ref;
+	struct cobs_decoder dec;
+	size_t rounds = ROUNDS_BYTES / len;
+	size_t n_old, n_new, i;
+	volatile uint32_t acc = 0;
+	double t0, t_enc_old, t_enc_new, t_dec_old, t_dec_new;
+
+	for (i = 0; i < len; i++)
+		data[i] = (test_rand() % 32) ? test_rand() : 0;
+
+	cobs_ref_init(&ref, dec_buf_old, sizeof(dec_buf_old), sink_cb,
+	              &sink_old);
+	cobs_decoder_init(&dec, dec_buf_new, sizeof(dec_buf_new), sink_cb,
+	                  &sink_new);
+
+	/* identical output */
+	n_old = encode_old(enc_old, data, len);
+	n_new = encode_new(enc_new, data, len);
+	CHECK_EQ(n_old, n_new);
+	CHECK(!memcmp(enc_old, enc_new, n_old));
+	cobs_ref_put(&ref, enc_old, n_old);
+	cobs_decoder_put(&dec, enc_new, n_new);
+	CHECK_EQ(sink_old.frames, 1);
+	CHECK_EQ(sink_new.frames, 1);
+	CHECK_EQ(sink_old.len, sink_new.len);
+	CHECK(!memcmp(sink_old.data, sink_new.data, sink_old.len));
+	CHECK_EQ(crc16_block(sink_old.data, sink_old.len), 0);
+	CHECK_EQ(dec.crc, 0);
+
+	t0 = test_now();
+	for (i = 0; i < rounds; i++)
+		acc += encode_old(enc_old, data, len);
+	t_enc_old = test_now() - t0;
+
+	t0 = test_now();
+	for (i = 0; i < rounds; i++)
+		acc += encode_new(enc_new, data, len);
+	t_enc_new = test_now() - t0;
+
+	t0 = test_now();
+	for (i = 0; i < rounds; i++) {
+		cobs_ref_put(&ref, enc_old, n_old);
+		acc += crc16_block(sink_old.data, sink_old.len);
+	}
+	t_dec_old = test_now() - t0;
+
+	t0 = test_now();
+	for (i = 0; i < rounds; i++) {
+		cobs_decoder_put(&dec, enc_new, n_new);
+		acc += dec.crc;
+	}
+	t_dec_new = test_now() - t0;
+
+	printf("%5d B  encode: old %7.1f MB/s, new %7.1f MB/s  "
+	       "decode: old %7.1f MB/s, new %7.1f MB/s\n", (int)len,
+	       ROUNDS_BYTES / t_enc_old / 1e6, ROUNDS_BYTES / t_enc_new / 1e6,
+	       ROUNDS_BYTES / t_dec_old / 1e6, ROUNDS_BYTES / t_dec_new / 1e6);
+}
+
+int main(void)
+{
+	bench(64);
+	bench(512);
+	bench(1500);
+	return test_result("bench_cobs");
+}
@@ -0,0 +1,73 @@
+/* Reference byte-at-a-time COBS decoder, the state machine the firmware
+   used before the run-copying one, with the 0xFF block and overflow cases
+   fixed. Frames are passed to callback only if they fit the buffer. Crc
+   is checked separately by the caller. */
+#ifndef _COBS_REF_H_
+#define _COBS_REF_H_
+#include <stdint.h>
+#include <stddef.h>
+
+struct cobs_ref {
+	uint8_t *buf;
+	size_t size;
+	size_t ind;
+	unsigned cnt; /* bytes left in block, including code byte */
+	unsigned len; /* code byte of current block */
+	int in_frame;
+	int overflow;
+	void (*cb)(void *, uint8_t *, size_t);
+	void *arg;
+};
+
+static inline void
+cobs_ref_init(struct cobs_ref *r, uint8_t *buf, size_t size,
+              void (*cb)(void *, uint8_t *, size_t), void *arg)
+{
+	r->buf = buf;
+	r->size = size;
+	r->in_frame = 0;
+	r->cb = cb;
+	r->arg = arg;
+}
+
+static inline void cobs_ref_out(struct cobs_ref *r, uint8_t ch)
+{
+	if (r->ind < r->size)
+		r->buf[r->ind++] = ch;
+	else
+		r->overflow = 1;
+}
+
+static inline void
+cobs_ref_put(struct cobs_ref *r, const uint8_t *src, size_t n)
+{
+	while (n--) {
+		uint8_t ch = *src++;
+
+		if (!r->in_frame) {
+			if (ch) {
+				r->ind = 0;
+				r->overflow = 0;
+				r->cnt = r->len = ch;
+				r->in_frame = 1;
+			}
+			continue;
+		}
+
+		if (!ch) {
+			/* delimiter inside a block means truncated frame */
+			if ((r->cnt == 1) && !r->overflow)
+				r->cb(r->arg, r->buf, r->ind);
+			r->in_frame = 0;
+		} else if (r->cnt == 1) {
+			if (r->len != 0xFF)
+				cobs_ref_out(r, 0);
+			r->cnt = r->len = ch;
+		} else {
+			r->cnt--;
+			cobs_ref_out(r, ch);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,32 @@
+/* Host replacement for the SDK header, just enough for modules that are
+   built into tests. */
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+typedef enum {
+	OK = 0,
+	FAIL,
+	PENDING,
+	BUSY,
+	CANCEL,
+} STATUS;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define LOCAL static
+#define SHMEM_ATTR
+
+#endif
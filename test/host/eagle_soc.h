@@ -0,0 +1,27 @@
+/* Host replacement for the SDK header. Peripheral registers are modelled
+   by the test (sdk.c), uart fifos in particular. */
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+#include "c_types.h"
+
+uint32_t host_reg_read(uint32_t addr);
+void host_reg_write(uint32_t addr, uint32_t val);
+
+#define READ_PERI_REG(addr) host_reg_read(addr)
+#define WRITE_PERI_REG(addr, val) host_reg_write((addr), (val))
+#define SET_PERI_REG_MASK(reg, mask) \
+	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) | (mask)))
+#define CLEAR_PERI_REG_MASK(reg, mask) \
+	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) & ~(mask)))
+
+#define BIT(n) (1UL << (n))
+#define BIT0 BIT(0)
+#define BIT1 BIT(1)
+#define BIT2 BIT(2)
+#define BIT3 BIT(3)
+#define BIT4 BIT(4)
+#define BIT5 BIT(5)
+
+#define UART_CLK_FREQ 80000000
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _ETS_SYS_H_
+#define _ETS_SYS_H_
+#include "c_types.h"
+#include "eagle_soc.h"
+
+typedef uint32_t os_signal_t;
+typedef uint32_t os_param_t;
+
+typedef struct {
+	os_signal_t sig;
+	os_param_t par;
+} os_event_t;
+
+typedef void (*os_task_t)(os_event_t *e);
+
+typedef void ETSTimerFunc(void *);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *next;
+	uint32_t expire;
+	uint32_t period;
+	ETSTimerFunc *func;
+	void *arg;
+} ETSTimer;
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+
+#endif
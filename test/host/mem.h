@@ -0,0 +1,9 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+#include <stdlib.h>
+
+#define os_malloc malloc
+#define os_zalloc(n) calloc(1, (n))
+#define os_free free
+
+#endif
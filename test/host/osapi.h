@@ -0,0 +1,20 @@
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+#include <stdio.h>
+#include <string.h>
+#include "c_types.h"
+#include "ets_sys.h"
+
+#define os_memcpy memcpy
+#define os_memset memset
+#define os_memcmp memcmp
+#define os_printf printf
+#define os_sprintf(buf, ...) sprintf((char *)(buf), __VA_ARGS__)
+
+typedef ETSTimer os_timer_t;
+
+void os_timer_setfn(os_timer_t *t, ETSTimerFunc *fn, void *arg);
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat);
+void os_timer_disarm(os_timer_t *t);
+
+#endif
@@ -0,0 +1,28 @@
+/* pbuf functions used by modules under test. Tests build pbuf chains
+   themselves, on stack or in static buffers. */
+#include <string.h>
+
+#include "lwip/pbuf.h"
+
+u16_t
+pbuf_copy_partial(struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+	u16_t done = 0;
+
+	for (; p && (done < len); p = p->next) {
+		u16_t n;
+
+		if (offset >= p->len) {
+			offset -= p->len;
+			continue;
+		}
+		n = p->len - offset;
+		if (n > len - done)
+			n = len - done;
+		memcpy((uint8_t *)dataptr + done,
+		       (uint8_t *)p->payload + offset, n);
+		done += n;
+		offset = 0;
+	}
+	return done;
+}
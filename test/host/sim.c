@@ -0,0 +1,368 @@
+/* Simulated SDK, see sim.h. Interrupt handler runs whenever one of its
+   enabled sources is active and interrupts are not locked, like on the
+   module: right after uart0_tx_intr_enable(), after comm_intr_unlock()
+   and as fifos fill or drain. Tasks run between steps of virtual time. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c_types.h"
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "sim.h"
+
+#define FIFO_SIZE 128
+#define RX_FULL_THRESHOLD 16 // as configured by uart_init()
+#define RX_LINE_SIZE (1 << 16)
+#define TASK_QUEUE_LEN 32
+#define TASK_PRIOS 3
+
+void uart0_rx_intr_handler(void *para);
+
+static uint64_t now_ns;
+static uint64_t byte_ns;
+static sim_tx_cb_t tx_cb;
+
+static uint8_t tx_fifo[FIFO_SIZE];
+static uint32_t tx_read, tx_write;     // free-running
+static uint64_t tx_done_ns;            // end of byte being sent
+static uint32_t tx_threshold;
+
+static uint8_t rx_fifo[FIFO_SIZE];
+static uint32_t rx_read, rx_write;
+static uint8_t rx_line[RX_LINE_SIZE];  // bytes host is about to send
+static uint32_t rx_line_read, rx_line_write;
+static uint64_t rx_next_ns;            // arrival of next byte
+static uint64_t rx_last_ns;            // arrival of last byte
+static bool rx_ovf;
+
+static uint32_t int_ena;
+static uint32_t conf0, conf1;
+
+static int lock_depth;
+static bool in_isr;
+
+static os_task_t tasks[TASK_PRIOS];
+static os_event_t task_queue[TASK_QUEUE_LEN];
+static uint8_t task_queue_prio[TASK_QUEUE_LEN];
+static uint32_t task_read, task_write;
+
+static os_timer_t *timers;             // armed ones, unordered
+
+
+/* ------------------------------------------------------------------ uart */
+
+static uint32_t
+int_raw(void)
+{
+	uint32_t raw = 0;
+	uint32_t rx_cnt = rx_write - rx_read;
+
+	if (tx_write - tx_read < tx_threshold)
+		raw |= UART_TXFIFO_EMPTY_INT_RAW;
+	if (rx_cnt >= RX_FULL_THRESHOLD)
+		raw |= UART_RXFIFO_FULL_INT_RAW;
+	// line idle for 2 bytes with data left in fifo
+	if (rx_cnt && (now_ns >= rx_last_ns + 2 * byte_ns))
+		raw |= UART_RXFIFO_TOUT_INT_RAW;
+	if (rx_ovf)
+		raw |= UART_RXFIFO_OVF_INT_RAW;
+	return raw;
+}
+
+static void
+check_interrupt(void)
+{
+	int guard = 0;
+
+	if (lock_depth || in_isr)
+		return;
+
+	while (int_raw() & int_ena) {
+		in_isr = true;
+		uart0_rx_intr_handler(NULL);
+		in_isr = false;
+		if (++guard > 1000) {
+			fprintf(stderr, "sim: interrupt storm, raw %x ena %x\n",
+			        int_raw(), int_ena);
+			abort();
+		}
+	}
+}
+
+uint32_t
+host_reg_read(uint32_t addr)
+{
+	if (addr == UART_FIFO(0)) {
+		if (rx_read == rx_write)
+			return 0;
+		return rx_fifo[rx_read++ % FIFO_SIZE];
+	}
+	if (addr == UART_STATUS(0))
+		return ((tx_write - tx_read) << UART_TXFIFO_CNT_S) |
+		       ((rx_write - rx_read) << UART_RXFIFO_CNT_S);
+	if (addr == UART_INT_RAW(0))
+		return int_raw();
+	if (addr == UART_INT_ST(0))
+		return int_raw() & int_ena;
+	if (addr == UART_INT_ENA(0))
+		return int_ena;
+	if (addr == UART_CONF0(0))
+		return conf0;
+	if (addr == UART_CONF1(0))
+		return conf1;
+	return 0;
+}
+
+void
+host_reg_write(uint32_t addr, uint32_t val)
+{
+	if (addr == UART_FIFO(0)) {
+		if (tx_write - tx_read < FIFO_SIZE)
+			tx_fifo[tx_write++ % FIFO_SIZE] = val;
+		if (tx_done_ns < now_ns)
+			tx_done_ns = now_ns;
+	} else if (addr == UART_INT_CLR(0)) {
+		if (val & UART_RXFIFO_OVF_INT_CLR)
+			rx_ovf = false;
+	} else if (addr == UART_INT_ENA(0)) {
+		int_ena = val;
+		check_interrupt();
+	} else if (addr == UART_CONF0(0)) {
+		conf0 = val;
+	} else if (addr == UART_CONF1(0)) {
+		conf1 = val;
+	}
+}
+
+void
+uart_init(UartBautRate uart0_br, UartBautRate uart1_br)
+{
+}
+
+void
+uart0_set_tx_empty_threshold(uint8 threshold)
+{
+	tx_threshold = threshold;
+}
+
+void
+uart0_set_flow_ctrl(UartFlowCtrl mode)
+{
+}
+
+STATUS
+uart_tx_one_char(uint8 uart, uint8 c)
+{
+	host_reg_write(UART_FIFO(0), c);
+	return OK;
+}
+
+
+/* ------------------------------------------------------- interrupts, time */
+
+void
+ets_intr_lock(void)
+{
+	lock_depth++;
+}
+
+void
+ets_intr_unlock(void)
+{
+	if (--lock_depth == 0)
+		check_interrupt();
+}
+
+uint32_t
+get_ccount(void)
+{
+	return now_ns * 80 / 1000;
+}
+
+uint32
+system_get_time(void)
+{
+	return now_ns / 1000;
+}
+
+uint64_t
+sim_now(void)
+{
+	return now_ns / 1000;
+}
+
+
+/* ---------------------------------------------------------- tasks, timers */
+
+bool
+system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen)
+{
+	tasks[prio] = task;
+	return true;
+}
+
+bool
+system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+	uint32_t i = task_write % TASK_QUEUE_LEN;
+
+	if (task_write - task_read == TASK_QUEUE_LEN)
+		return false;
+	task_queue[i].sig = sig;
+	task_queue[i].par = par;
+	task_queue_prio[i] = prio;
+	task_write++;
+	return true;
+}
+
+void
+os_timer_setfn(os_timer_t *t, ETSTimerFunc *fn, void *arg)
+{
+	os_timer_disarm(t);
+	t->func = fn;
+	t->arg = arg;
+}
+
+void
+os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat)
+{
+	os_timer_disarm(t);
+	t->expire = (now_ns / 1000000) + ms;
+	t->period = repeat ? ms : 0;
+	t->next = timers;
+	timers = t;
+}
+
+void
+os_timer_disarm(os_timer_t *t)
+{
+	os_timer_t **p;
+
+	for (p = &timers; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	t->next = NULL;
+}
+
+static void
+run_timers(void)
+{
+	uint32_t ms = now_ns / 1000000;
+	os_timer_t *t;
+
+	for (t = timers; t; t = t->next) {
+		if ((int32_t)(ms - t->expire) < 0)
+			continue;
+		if (t->period)
+			t->expire += t->period;
+		else
+			os_timer_disarm(t);
+		t->func(t->arg);
+		// list may have changed
+		run_timers();
+		return;
+	}
+}
+
+void
+sim_run(void)
+{
+	check_interrupt();
+	while (task_read != task_write) {
+		uint32_t i = task_read++ % TASK_QUEUE_LEN;
+		os_event_t e = task_queue[i];
+
+		if (tasks[task_queue_prio[i]])
+			tasks[task_queue_prio[i]](&e);
+		check_interrupt();
+	}
+}
+
+
+/* -------------------------------------------------------------------- sim */
+
+void
+sim_init(uint32_t baud, sim_tx_cb_t cb)
+{
+	now_ns = 0;
+	tx_read = tx_write = 0;
+	tx_done_ns = 0;
+	rx_read = rx_write = 0;
+	rx_line_read = rx_line_write = 0;
+	rx_ovf = false;
+	int_ena = 0;
+	lock_depth = 0;
+	task_read = task_write = 0;
+	timers = NULL;
+	tx_cb = cb;
+	sim_set_baud(baud);
+}
+
+void
+sim_set_baud(uint32_t baud)
+{
+	byte_ns = 10 * 1000000000ULL / baud; // 8N1
+}
+
+size_t
+sim_rx_put(const uint8_t *data, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (rx_line_write - rx_line_read == RX_LINE_SIZE)
+			break;
+		if (rx_line_write == rx_line_read)
+			rx_next_ns = now_ns + byte_ns;
+		rx_line[rx_line_write++ % RX_LINE_SIZE] = data[i];
+	}
+	return i;
+}
+
+// One step: at most one byte leaves and one arrives
+void
+sim_advance(uint64_t us)
+{
+	uint64_t end = now_ns + us * 1000;
+
+	sim_run();
+	while (now_ns < end) {
+		uint64_t next = end;
+
+		if ((tx_write != tx_read) && (tx_done_ns + byte_ns < next))
+			next = tx_done_ns + byte_ns;
+		if ((rx_line_write != rx_line_read) && (rx_next_ns < next))
+			next = rx_next_ns;
+		if (next < now_ns)
+			next = now_ns;
+		now_ns = next;
+
+		if ((tx_write != tx_read) && (tx_done_ns + byte_ns <= now_ns)) {
+			uint8_t c = tx_fifo[tx_read++ % FIFO_SIZE];
+			tx_done_ns += byte_ns;
+			if (tx_cb)
+				tx_cb(c);
+		}
+		if (tx_write == tx_read)
+			tx_done_ns = now_ns;
+
+		if ((rx_line_write != rx_line_read) && (rx_next_ns <= now_ns)) {
+			uint8_t c = rx_line[rx_line_read++ % RX_LINE_SIZE];
+			if (rx_write - rx_read < FIFO_SIZE)
+				rx_fifo[rx_write++ % FIFO_SIZE] = c;
+			else
+				rx_ovf = true;
+			rx_last_ns = now_ns;
+			rx_next_ns = now_ns + byte_ns;
+		}
+
+		run_timers();
+		sim_run();
+	}
+}
@@ -0,0 +1,24 @@
+/* Simulated SDK for host-built tests: virtual time, uart0 with 128 byte
+   fifos draining at line rate, its interrupt, task queue and timers.
+   Modules are linked unchanged, e.g. comm.c runs its interrupt handler
+   and task exactly as on the module. */
+#ifndef _SIM_H_
+#define _SIM_H_
+#include "c_types.h"
+
+// Called with every byte module puts on the line, time is when its stop
+// bit is sent
+typedef void (*sim_tx_cb_t)(uint8_t byte);
+
+void sim_init(uint32_t baud, sim_tx_cb_t tx_cb);
+void sim_set_baud(uint32_t baud);
+// Moves virtual time forward, running uart, interrupts, timers and tasks
+void sim_advance(uint64_t us);
+// Runs posted tasks and pending interrupts without moving time
+void sim_run(void);
+// Bytes from host, they arrive into rx fifo at line rate during
+// sim_advance(). Returns number of bytes accepted into the sim buffer.
+size_t sim_rx_put(const uint8_t *data, size_t n);
+uint64_t sim_now(void); // us
+
+#endif
@@ -0,0 +1,17 @@
+/* Host replacement for the SDK header, tasks and time are simulated by
+   sdk.c */
+#ifndef _USER_INTERFACE_H_
+#define _USER_INTERFACE_H_
+#include "c_types.h"
+#include "ets_sys.h"
+
+#define USER_TASK_PRIO_0 0
+#define USER_TASK_PRIO_1 1
+#define USER_TASK_PRIO_2 2
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue,
+                    uint8 qlen);
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+uint32 system_get_time(void);
+
+#endif
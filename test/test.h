@@ -0,0 +1,57 @@
+/* Minimal checks for host-built tests. Every test is a separate program
+   that exits with non-zero status if any check failed. */
+#ifndef _TEST_H_
+#define _TEST_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+		        __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	long long __a = (a), __b = (b); \
+	if (__a != __b) { \
+		fprintf(stderr, "%s:%d: check failed: %s == %s " \
+		        "(%lld != %lld)\n", __FILE__, __LINE__, #a, #b, \
+		        __a, __b); \
+		test_failures++; \
+	} \
+} while (0)
+
+static inline int test_result(const char *name)
+{
+	if (test_failures)
+		fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+	else
+		printf("%s: ok\n", name);
+	return test_failures != 0;
+}
+
+/* xorshift32, deterministic so failures are reproducible */
+static uint32_t test_rand_state = 2463534242u;
+
+static inline uint32_t test_rand(void)
+{
+	uint32_t x = test_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return test_rand_state = x;
+}
+
+static inline double test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif
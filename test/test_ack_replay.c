@@ -0,0 +1,400 @@
+/* ACK thinning: classify_parse() must mark only pure IPv4 ACKs (optionally
+   with timestamps) as superseded by newer ones, then a TCP replay sends
+   ACK streams of a few flows mixed with bulk data through comm.c the way
+   send_pbuf() in user_main.c does, into a uart simulated in host/sim.c.
+
+   Checks on the decoded line: ACKs of a flow never go backwards, last ACK
+   of each flow reaches host, duplicate ACKs are not merged (only the last
+   of a run may be replaced by a newer ACK), data arrives intact, and
+   queued ACKs were actually replaced. A queued ACK must survive a newer
+   one that doesn't fit into the queue. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "sim.h"
+#include "classify.h"
+#include "comm.h"
+#include "cobs.h"
+#include "crc16.h"
+
+#define BAUD 921600
+#define FLOWS 3
+#define MAX_ACKS 20000
+#define DATA_LEN 300
+#define MAX_DATA 1000
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+struct flow {
+	uint32_t ack;            // last sent
+	uint32_t wire_ack;       // last seen on line
+	bool seen;
+};
+
+static struct flow flows[FLOWS];
+
+// Every ACK sent, in order, to count duplicates on the line
+static uint32_t sent_ack[FLOWS][MAX_ACKS];
+static uint32_t sent_n[FLOWS];
+static uint32_t wire_ack[FLOWS][MAX_ACKS];
+static uint32_t wire_n[FLOWS];
+
+static uint32_t data_sent, data_got, data_bad;
+static uint32_t backwards, bad_frames;
+
+static struct cobs_decoder dec;
+static uint8_t dec_buf[2 * MAX_MESSAGE_SIZE];
+
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// IPv4 + TCP with opt_len bytes of options and payload_len of payload,
+// returns total length
+static size_t make_tcp(uint8_t *b, int flow, uint8_t flags, uint32_t ack,
+                       const uint8_t *opt, size_t opt_len, size_t payload_len)
+{
+	size_t hl = 20 + opt_len;
+	size_t len = 20 + hl + payload_len;
+	uint8_t *t = b + 20;
+
+	memset(b, 0, 40);
+	b[0] = 0x45;
+	put16(b + 2, len);
+	b[8] = 64;
+	b[9] = 6;
+	put32(b + 12, 0xc0a80001);
+	put32(b + 16, 0xc0a80064 + flow);
+	put16(t, 80);
+	put16(t + 2, 40000 + flow);
+	put32(t + 4, 1000);
+	put32(t + 8, ack);
+	t[12] = (hl / 4) << 4;
+	t[13] = flags;
+	put16(t + 14, 65535);
+	memcpy(t + 20, opt, opt_len);
+	return len;
+}
+
+static void pbuf_wrap(struct pbuf *p, uint8_t *data, size_t len)
+{
+	memset(p, 0, sizeof(*p));
+	p->payload = data;
+	p->len = p->tot_len = len;
+}
+
+
+/* ----------------------------------------------------------- classification */
+
+static bool parse_ack_only(uint8_t *b, size_t len, size_t split)
+{
+	struct pbuf p[2];
+	struct pkt_info pi;
+
+	pbuf_wrap(&p[0], b, split ? split : len);
+	if (split) {
+		pbuf_wrap(&p[1], b + split, len - split);
+		p[0].next = &p[1];
+		p[0].tot_len = len;
+	}
+	CHECK(classify_parse(&p[0], false, &pi));
+	if (pi.ack_only)
+		CHECK_EQ(pi.ack, 0x12345678);
+	return pi.ack_only;
+}
+
+static void test_classify(void)
+{
+	static const uint8_t ts[12] = { 1, 1, 8, 10 };
+	static const uint8_t sack[12] = { 1, 1, 5, 10 };
+	static const uint8_t mss[4] = { 2, 4, 5, 0xb4 };
+	uint8_t b[100];
+	size_t len;
+
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, NULL, 0, 0);
+	CHECK(parse_ack_only(b, len, 0));
+	// headers split between segments are copied
+	CHECK(parse_ack_only(b, len, 30));
+
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, ts, sizeof(ts), 0);
+	CHECK(parse_ack_only(b, len, 0));
+	CHECK(parse_ack_only(b, len, 45));
+
+	// SACK blocks carry information a newer ACK may not repeat
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, sack, sizeof(sack), 0);
+	CHECK(!parse_ack_only(b, len, 0));
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, mss, sizeof(mss), 0);
+	CHECK(!parse_ack_only(b, len, 0));
+
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, NULL, 0, 10);
+	CHECK(!parse_ack_only(b, len, 0));
+	len = make_tcp(b, 0, TCP_ACK | TCP_SYN, 0x12345678, NULL, 0, 0);
+	CHECK(!parse_ack_only(b, len, 0));
+	len = make_tcp(b, 0, TCP_ACK | TCP_FIN, 0x12345678, NULL, 0, 0);
+	CHECK(!parse_ack_only(b, len, 0));
+
+	// timestamp option cut short by ip length
+	len = make_tcp(b, 0, TCP_ACK, 0x12345678, ts, sizeof(ts), 0);
+	put16(b + 2, len - 4);
+	CHECK(!parse_ack_only(b, len - 4, 0));
+}
+
+
+/* ------------------------------------------------------------------- replay */
+
+static void frame_cb(void *arg, uint8_t *data, size_t len)
+{
+	const uint8_t *ip, *t;
+	uint32_t ack, id, i;
+	int flow;
+
+	if (dec.crc || (len < 3 + 40) || (data[0] != MSG_IP_PACKET)) {
+		if (len && !dec.crc && (data[0] != MSG_IP_PACKET))
+			return; // control message
+		bad_frames++;
+		return;
+	}
+	ip = data + 1;
+	t = ip + 20;
+	flow = ip[19] - 0x64;
+	if ((flow < 0) || (flow >= FLOWS)) {
+		bad_frames++;
+		return;
+	}
+
+	if (((ip[2] << 8) | ip[3]) > 20 + 4 * (t[12] >> 4)) {
+		memcpy(&id, t + 20, 4);
+		for (i = 4; i < DATA_LEN; i++)
+			if (t[20 + i] != (uint8_t)(id + i))
+				break;
+		if ((i != DATA_LEN) || (id != data_got))
+			data_bad++;
+		data_got++;
+		return;
+	}
+
+	ack = get32(t + 8);
+	if (flows[flow].seen && ((int32_t)(ack - flows[flow].wire_ack) < 0))
+		backwards++;
+	flows[flow].seen = true;
+	flows[flow].wire_ack = ack;
+	if (wire_n[flow] < MAX_ACKS)
+		wire_ack[flow][wire_n[flow]++] = ack;
+}
+
+static void tx_byte(uint8_t c)
+{
+	cobs_decoder_put(&dec, &c, 1);
+}
+
+// As send_pbuf() in user_main.c
+static void send(uint8_t *b, size_t len)
+{
+	struct comm_iovec iov = { b, len };
+	struct pbuf p;
+	struct pkt_info pi;
+	size_t prio;
+
+	pbuf_wrap(&p, b, len);
+	CHECK(classify_parse(&p, false, &pi));
+	prio = classify(&pi);
+	if (pi.ack_only) {
+		struct comm_ack_key key = {
+			.src = pi.src,
+			.dst = pi.dst,
+			.sport = pi.sport,
+			.dport = pi.dport,
+		};
+		comm_sendv_ack(MSG_IP_PACKET, &iov, 1, prio, &key, pi.ack);
+	} else {
+		comm_sendv(MSG_IP_PACKET, &iov, 1, prio);
+	}
+}
+
+static void send_ack(int flow)
+{
+	static const uint8_t ts[12] = { 1, 1, 8, 10 };
+	struct flow *f = &flows[flow];
+	uint8_t b[60];
+	size_t len;
+
+	// runs of duplicates, otherwise up to a few segments. Flow 1 has
+	// timestamps, flow 2 mixes ACKs with and without, those can't be
+	// written over queued ones.
+	if (test_rand() % 8)
+		f->ack += 1 + test_rand() % 4000;
+	len = make_tcp(b, flow, TCP_ACK, f->ack, ts,
+	               (flow == 1) || ((flow == 2) && (test_rand() % 2)) ?
+	               sizeof(ts) : 0, 0);
+	send(b, len);
+	if (sent_n[flow] < MAX_ACKS)
+		sent_ack[flow][sent_n[flow]++] = f->ack;
+}
+
+static void send_data(void)
+{
+	uint8_t b[40 + DATA_LEN];
+	uint32_t id = data_sent++, i;
+	size_t len;
+
+	len = make_tcp(b, id % FLOWS, TCP_ACK, flows[id % FLOWS].ack, NULL, 0,
+	               DATA_LEN);
+	for (i = 4; i < DATA_LEN; i++)
+		b[40 + i] = id + i;
+	memcpy(b + 40, &id, 4);
+	send(b, len);
+}
+
+// Every run of k equal ACKs sent must show up at least k - 1 times, only
+// the last one may be replaced by a newer ACK.
+static void check_dups(int flow)
+{
+	uint32_t i = 0, run, seen, w;
+
+	while (i < sent_n[flow]) {
+		for (run = 1; (i + run < sent_n[flow]) &&
+		     (sent_ack[flow][i + run] == sent_ack[flow][i]); run++)
+			;
+		for (seen = 0, w = 0; w < wire_n[flow]; w++)
+			if (wire_ack[flow][w] == sent_ack[flow][i])
+				seen++;
+		if (run > 1)
+			CHECK(seen >= run - 1);
+		i += run;
+	}
+}
+
+static void replay_init(void)
+{
+	memset(flows, 0, sizeof(flows));
+	memset(sent_n, 0, sizeof(sent_n));
+	memset(wire_n, 0, sizeof(wire_n));
+	data_sent = data_got = data_bad = 0;
+	backwards = bad_frames = 0;
+
+	sim_init(BAUD, tx_byte);
+	cobs_decoder_init(&dec, dec_buf, sizeof(dec_buf), frame_cb, NULL);
+	comm_init(NULL);
+}
+
+static void test_replay(void)
+{
+	struct comm_stats st;
+	uint32_t ms;
+	int i;
+
+	replay_init();
+
+	for (i = 0; i < FLOWS; i++)
+		flows[i].ack = test_rand();
+
+	// ACKs of every flow each 2 ms and a data packet each 10 ms, which
+	// fits the line only if ACKs are thinned
+	for (ms = 0; ms < 5000; ms++) {
+		if (!(ms % 2))
+			for (i = 0; i < FLOWS; i++)
+				send_ack(i);
+		if (!(ms % 10) && (data_sent < MAX_DATA))
+			send_data();
+		sim_advance(1000);
+	}
+	sim_advance(3000000);
+
+	comm_get_stats(&st);
+	printf("  %d acks sent, %d on line, replaced %d, dropped %d, "
+	       "%d bytes saved\n",
+	       (int)(sent_n[0] + sent_n[1] + sent_n[2]),
+	       (int)(wire_n[0] + wire_n[1] + wire_n[2]),
+	       (int)st.tx_acks_replaced, (int)st.tx_acks_dropped,
+	       (int)st.tx_ack_bytes_saved);
+
+	CHECK_EQ(bad_frames, 0);
+	CHECK_EQ(backwards, 0);
+	CHECK_EQ(st.dropped_packets, 0);
+	CHECK_EQ(data_got, data_sent);
+	CHECK_EQ(data_bad, 0);
+	for (i = 0; i < FLOWS; i++) {
+		CHECK(flows[i].seen);
+		CHECK_EQ(flows[i].wire_ack, flows[i].ack);
+		CHECK(wire_n[i] < sent_n[i]);
+		check_dups(i);
+	}
+	CHECK(st.tx_acks_replaced > 0);
+	CHECK(st.tx_acks_dropped > 0);
+	CHECK(st.tx_ack_bytes_saved > 0);
+}
+
+// Newer ACK of a different size that doesn't fit into the full queue must
+// not take the queued one with it
+static void test_full_queue(void)
+{
+	static const uint8_t ts[12] = { 1, 1, 8, 10 };
+	struct comm_stats st;
+	uint8_t b[60];
+	size_t len;
+
+	replay_init();
+	CHECK(comm_set_tx_queue(COMM_TX_PRIO_MEDIUM, 2, 2048, 0));
+
+	// data being sent keeps ACKs in queue
+	send_data();
+	len = make_tcp(b, 0, TCP_ACK, 200, NULL, 0, 0);
+	send(b, len);
+	len = make_tcp(b, 1, TCP_ACK, 100, NULL, 0, 0);
+	send(b, len);
+	len = make_tcp(b, 0, TCP_ACK, 300, ts, sizeof(ts), 0);
+	send(b, len);
+	sim_advance(100000);
+
+	comm_get_stats(&st);
+	CHECK_EQ(st.dropped_packets, 1);
+	CHECK_EQ(st.tx_acks_dropped, 0);
+	CHECK_EQ(bad_frames, 0);
+	CHECK_EQ(wire_n[0], 1);
+	CHECK_EQ(flows[0].wire_ack, 200);
+	CHECK_EQ(wire_n[1], 1);
+
+	// with room the new one is queued and the old one skipped
+	send_data();
+	len = make_tcp(b, 0, TCP_ACK, 400, NULL, 0, 0);
+	send(b, len);
+	len = make_tcp(b, 0, TCP_ACK, 500, NULL, 0, 0);
+	send(b, len);
+	len = make_tcp(b, 0, TCP_ACK, 600, ts, sizeof(ts), 0);
+	send(b, len);
+	sim_advance(100000);
+
+	comm_get_stats(&st);
+	CHECK_EQ(st.tx_acks_dropped, 1);
+	CHECK_EQ(st.tx_acks_replaced, 1);
+	CHECK_EQ(wire_n[0], 2);
+	CHECK_EQ(flows[0].wire_ack, 600);
+	CHECK_EQ(backwards, 0);
+	CHECK_EQ(data_got, 2);
+	CHECK_EQ(data_bad, 0);
+}
+
+int main(void)
+{
+	test_classify();
+	test_replay();
+	test_full_queue();
+	return test_result("test_ack_replay");
+}
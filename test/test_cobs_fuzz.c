@@ -0,0 +1,230 @@
+/* Differential fuzz test of the run-copying COBS decoder against the
+   byte-at-a-time reference (cobs_ref.h). Streams of valid frames, frames
+   with 0xFF blocks, truncated frames and random garbage are fed to the
+   decoder in random chunks, and to the reference in one piece. Both must
+   deliver the same frames, decoder's running crc must match crc16 of the
+   frame. Split and redirect (used to decode straight into pbufs) must not
+   change the output either, nor stopping the decoder after random frames
+   and feeding the rest again (how comm holds messages back).
+   Throughput is measured by `make bench-host`. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "cobs.h"
+#include "crc16.h"
+#include "cobs_ref.h"
+
+#define MAX_FRAME 1700
+#define MAX_FRAMES 256
+#define STREAM_SIZE 65536
+
+struct frame {
+	size_t len;
+	uint16_t crc;
+	uint8_t data[MAX_FRAME];
+};
+
+struct frames {
+	struct frame f[MAX_FRAMES];
+	size_t n;
+};
+
+static struct frames got_ref, got_dec;
+static struct cobs_decoder dec;
+
+/* split / redirect: first SPLIT bytes stay in base buffer, the rest goes
+   to another one */
+#define SPLIT 3
+static uint8_t redirect_buf[MAX_FRAME];
+static uint8_t split_hdr[SPLIT];
+static bool random_stop;
+
+static void ref_cb(void *arg, uint8_t *data, size_t len)
+{
+	struct frame *f;
+
+	if (got_ref.n == MAX_FRAMES)
+		return;
+	f = &got_ref.f[got_ref.n++];
+	f->len = len;
+	memcpy(f->data, data, len);
+	f->crc = crc16_block(data, len);
+}
+
+static void split_cb(void *arg, uint8_t *data, size_t len)
+{
+	memcpy(split_hdr, data, len);
+	cobs_decoder_redirect(&dec, redirect_buf, sizeof(redirect_buf) - SPLIT);
+}
+
+static void dec_cb(void *arg, uint8_t *data, size_t len)
+{
+	struct frame *f;
+
+	if (got_dec.n == MAX_FRAMES)
+		return;
+	f = &got_dec.f[got_dec.n++];
+	if (dec.redirected) {
+		memcpy(f->data, split_hdr, SPLIT);
+		memcpy(f->data + SPLIT, data, len);
+		len += SPLIT;
+	} else {
+		memcpy(f->data, data, len);
+	}
+	f->len = len;
+	f->crc = dec.crc;
+	if (random_stop && !(test_rand() % 3))
+		cobs_decoder_stop(&dec);
+}
+
+/* Frame contents hitting decoder corner cases */
+static size_t gen_frame(uint8_t *p)
+{
+	size_t len, i;
+
+	switch (test_rand() % 6) {
+	case 0: /* multiple of 254 non-zero bytes, block of 0xFF at the end */
+		len = 254 * (1 + test_rand() % 5);
+		for (i = 0; i < len; i++)
+			p[i] = 1 + test_rand() % 255;
+		break;
+	case 1: /* 0xFF block followed by zero */
+		len = 254 + 1 + test_rand() % 10;
+		for (i = 0; i < len; i++)
+			p[i] = (i == 254) ? 0 : 1 + test_rand() % 255;
+		break;
+	case 2: /* zeros only */
+		len = test_rand() % 20;
+		memset(p, 0, len);
+		break;
+	case 3: /* empty and tiny */
+		len = test_rand() % 3;
+		for (i = 0; i < len; i++)
+			p[i] = test_rand() % 2;
+		break;
+	default:
+		len = test_rand() % 1600;
+		for (i = 0; i < len; i++)
+			p[i] = (test_rand() % 10) ? test_rand() : 0;
+	}
+	return len;
+}
+
+/* Valid frames mixed with truncated ones and garbage */
+static size_t gen_stream(uint8_t *s, bool garbage_only)
+{
+	static uint8_t plain[MAX_FRAME];
+	size_t n = 0;
+
+	if (garbage_only) {
+		for (n = 0; n < STREAM_SIZE; n++) {
+			uint32_t r = test_rand() % 8;
+			s[n] = r == 0 ? 0 : r == 1 ? 0xff : r == 2 ? 1 :
+				test_rand();
+		}
+		return n;
+	}
+
+	while (n < STREAM_SIZE - 2 * MAX_FRAME) {
+		size_t len = gen_frame(plain);
+		size_t enc = cobs_encode(s + n, plain, len);
+
+		switch (test_rand() % 8) {
+		case 0: /* cut short, next frame starts after delimiter */
+			enc = test_rand() % enc;
+			s[n + enc++] = 0;
+			break;
+		case 1: /* garbage between frames */
+			n += enc;
+			enc = test_rand() % 8;
+			while (enc--)
+				s[n++] = test_rand();
+			enc = 0;
+			break;
+		case 2: /* extra delimiters */
+			s[n + enc++] = 0;
+			break;
+		}
+		n += enc;
+	}
+	return n;
+}
+
+static void compare(void)
+{
+	size_t i;
+
+	CHECK_EQ(got_dec.n, got_ref.n);
+	for (i = 0; (i < got_ref.n) && (i < got_dec.n); i++) {
+		struct frame *a = &got_ref.f[i], *b = &got_dec.f[i];
+
+		CHECK_EQ(a->len, b->len);
+		CHECK_EQ(a->crc, b->crc);
+		if (a->len == b->len)
+			CHECK(!memcmp(a->data, b->data, a->len));
+		if (test_failures)
+			return;
+	}
+}
+
+static void run(const uint8_t *s, size_t len, size_t buf_size, bool split)
+{
+	static uint8_t ref_buf[MAX_FRAME], dec_buf[MAX_FRAME];
+	struct cobs_ref ref;
+	size_t off = 0;
+
+	got_ref.n = 0;
+	got_dec.n = 0;
+
+	/* with split, frame starts in base buffer of SPLIT bytes and
+	   continues in redirect_buf, both together are buf_size */
+	cobs_ref_init(&ref, ref_buf, buf_size, ref_cb, NULL);
+	cobs_decoder_init(&dec, dec_buf, split ? SPLIT : buf_size, dec_cb,
+	                  NULL);
+	if (split)
+		cobs_decoder_set_split(&dec, SPLIT, split_cb);
+
+	cobs_ref_put(&ref, s, len);
+	while (off < len) {
+		size_t n = 1 + test_rand() % 300;
+		if (n > len - off)
+			n = len - off;
+		while (n) {
+			size_t done = cobs_decoder_put(&dec, s + off, n);
+			CHECK(done <= n);
+			CHECK(done == n || random_stop);
+			off += done;
+			n -= done;
+		}
+	}
+	compare();
+}
+
+int main(void)
+{
+	static uint8_t stream[STREAM_SIZE];
+	size_t i, len;
+
+	for (i = 0; (i < 300) && !test_failures; i++) {
+		bool garbage = (i % 4) == 3;
+
+		len = gen_stream(stream, garbage);
+		run(stream, len, MAX_FRAME, false);
+		/* small buffer: overflowing frames are dropped by both */
+		run(stream, len, 300, false);
+	}
+
+	for (i = 0; (i < 100) && !test_failures; i++) {
+		len = gen_stream(stream, false);
+		run(stream, len, sizeof(redirect_buf), true);
+	}
+
+	random_stop = true;
+	for (i = 0; (i < 100) && !test_failures; i++) {
+		len = gen_stream(stream, (i % 4) == 3);
+		run(stream, len, MAX_FRAME, (i % 2) == 1);
+	}
+
+	return test_result("test_cobs_fuzz");
+}
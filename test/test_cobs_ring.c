@@ -0,0 +1,189 @@
+/* Tx path: frames are COBS-encoded with crc straight into a byte ring
+   arena, the same way transmitter_pushv() does it. Checks that the output
+   is identical to the one-shot encoder and decodes back to the original
+   data, also across the wrap of the arena, and that no heap allocation is
+   made per frame. Reports frames/s against the old path, which allocated
+   a buffer for every frame. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "cobs.h"
+#include "crc16.h"
+
+#define ARENA_SIZE 16384 /* same as tx queue arenas in comm.c */
+#define ARENA_MASK (ARENA_SIZE - 1)
+#define MAX_FRAME 1602   /* packet and crc */
+
+static size_t malloc_calls;
+
+void *__real_malloc(size_t);
+
+void *__wrap_malloc(size_t n)
+{
+	malloc_calls++;
+	return __real_malloc(n);
+}
+
+static uint8_t arena[ARENA_SIZE];
+
+/* Encodes header and data with trailing crc at free-running position pos,
+   returns position after delimiter */
+static uint32_t encode_frame(uint32_t pos, const uint8_t *hdr, size_t hdr_len,
+                             const uint8_t *data, size_t len)
+{
+	struct cobs_encoder enc;
+	uint16_t crc = CRC16_INIT_VALUE;
+	uint8_t crc_buf[2];
+
+	cobs_encoder_init(&enc, arena, ARENA_MASK, pos);
+	cobs_encoder_put_crc(&enc, hdr, hdr_len, &crc);
+	cobs_encoder_put_crc(&enc, data, len, &crc);
+	crc_buf[0] = crc & 0xff;
+	crc_buf[1] = crc >> 8;
+	cobs_encoder_put(&enc, crc_buf, sizeof(crc_buf));
+	return cobs_encoder_finish(&enc);
+}
+
+struct decoded {
+	uint8_t buf[MAX_FRAME + 16];
+	size_t len;
+	size_t frames;
+	uint16_t crc;
+};
+
+static struct cobs_decoder dec;
+static struct decoded out;
+
+static void frame_cb(void *arg, uint8_t *data, size_t len)
+{
+	struct decoded *d = arg;
+	d->len = len;
+	d->crc = dec.crc;
+	d->frames++;
+}
+
+/* Frame content that exercises all COBS block kinds: zeros, runs longer
+   than 254 bytes without zero, random bytes */
+static void fill(uint8_t *p, size_t len)
+{
+	size_t i;
+	uint32_t kind = test_rand() % 4;
+
+	for (i = 0; i < len; i++) {
+		switch (kind) {
+		case 0: p[i] = test_rand(); break;
+		case 1: p[i] = 0; break;
+		case 2: p[i] = (test_rand() % 300) ? 0xff : 0; break;
+		default: p[i] = (test_rand() % 8) ? test_rand() | 1 : 0;
+		}
+	}
+}
+
+static void test_roundtrip(void)
+{
+	static uint8_t data[MAX_FRAME], linear[ARENA_SIZE], ref[ARENA_SIZE];
+	static uint8_t plain[MAX_FRAME + 3];
+	/* start close to the end of the arena and the 32-bit wrap */
+	uint32_t pos = 0xffffffff - 3 * ARENA_SIZE;
+	uint8_t hdr[3] = { 0x00, 0x17, 0x42 };
+	size_t iter, i;
+
+	cobs_decoder_init(&dec, out.buf, sizeof(out.buf), frame_cb, &out);
+
+	for (iter = 0; iter < 20000; iter++) {
+		size_t len = test_rand() % (MAX_FRAME - 1);
+		size_t hdr_len = 1 + test_rand() % 3;
+		uint32_t end, n;
+		uint16_t crc;
+
+		fill(data, len);
+		end = encode_frame(pos, hdr, hdr_len, data, len);
+		n = end - pos;
+		CHECK(n <= COBS_ENCODED_MAX_SIZE(hdr_len + len + 2) + 1);
+		for (i = 0; i < n; i++)
+			linear[i] = arena[(pos + i) & ARENA_MASK];
+
+		memcpy(plain, hdr, hdr_len);
+		memcpy(plain + hdr_len, data, len);
+		crc = crc16_block(plain, hdr_len + len);
+		plain[hdr_len + len] = crc & 0xff;
+		plain[hdr_len + len + 1] = crc >> 8;
+		CHECK_EQ(cobs_encode(ref, plain, hdr_len + len + 2), n);
+		CHECK(!memcmp(ref, linear, n));
+
+		out.frames = 0;
+		cobs_decoder_put(&dec, linear, n);
+		CHECK_EQ(out.frames, 1);
+		CHECK_EQ(out.len, hdr_len + len + 2);
+		CHECK_EQ(out.crc, 0);
+		CHECK(!memcmp(out.buf, plain, hdr_len + len));
+
+		if (test_failures)
+			break;
+		pos = end;
+	}
+}
+
+static void test_no_malloc(void)
+{
+	static uint8_t data[64];
+	uint32_t pos = 0;
+	size_t calls = malloc_calls;
+	int i;
+
+	fill(data, sizeof(data));
+	for (i = 0; i < 100000; i++)
+		pos = encode_frame(pos, data, 1, data + 1, sizeof(data) - 1);
+	CHECK_EQ(malloc_calls - calls, 0);
+}
+
+/* Old transmitter_push(): buffer from heap, crc and encoding in separate
+   passes, buffer freed after sending */
+static void bench(size_t len)
+{
+	static uint8_t data[MAX_FRAME];
+	const size_t n = 200000;
+	volatile uint8_t sink = 0;
+	uint32_t pos = 0;
+	double t0, t_old, t_new;
+	size_t i;
+
+	fill(data, len);
+
+	t0 = test_now();
+	for (i = 0; i < n; i++) {
+		uint8_t *buf = malloc(len + 2);
+		uint8_t *enc = malloc(COBS_ENCODED_MAX_SIZE(len + 2) + 1);
+		uint16_t crc;
+
+		memcpy(buf, data, len);
+		crc = crc16_block(buf, len);
+		buf[len] = crc & 0xff;
+		buf[len + 1] = crc >> 8;
+		cobs_encode(enc, buf, len + 2);
+		sink ^= enc[0];
+		free(buf);
+		free(enc);
+	}
+	t_old = test_now() - t0;
+
+	t0 = test_now();
+	for (i = 0; i < n; i++)
+		pos = encode_frame(pos, data, 1, data + 1, len - 1);
+	t_new = test_now() - t0;
+	sink ^= arena[0];
+
+	printf("  %4d byte frames: malloc + encode %8.0f frames/s, "
+	       "arena %8.0f frames/s\n", (int)len, n / t_old, n / t_new);
+}
+
+int main(void)
+{
+	test_roundtrip();
+	test_no_malloc();
+	bench(64);
+	bench(512);
+	bench(1500);
+	return test_result("test_cobs_ring");
+}
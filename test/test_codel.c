@@ -0,0 +1,232 @@
+/* Replays a packet trace through comm.c transmitter into simulated uart
+   and reports delay of packets to host, with tail drop only and with
+   CoDel on the bulk queue. Trace is read from a pcap file given as the
+   argument (timestamps and lengths are used, contents are not), or a
+   synthetic one is generated: 20 s of bursts above and below line rate.
+
+   Checks that CoDel keeps delay below that of a full queue, drops only
+   at dequeue, and that every frame delivered is intact and in order. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "sim.h"
+#include "comm.h"
+#include "cobs.h"
+#include "crc16.h"
+
+#define BAUD 115200 // default, 4096 byte bulk queue holds 350 ms
+#define BYTES_PER_SEC (BAUD / 10)
+#define MAX_PKTS 200000
+#define MIN_LEN 40
+#define MAX_PACKET_SIZE 1600 // as in user_main.c
+
+#define AQM_TARGET 50000    // us, about one 512 byte frame
+#define AQM_INTERVAL 300000
+
+struct pkt {
+	uint64_t t; // us
+	uint16_t len;
+};
+
+static struct pkt trace[MAX_PKTS];
+static size_t trace_n;
+
+struct result {
+	uint32_t *delay; // us, per delivered packet
+	size_t n;
+	uint32_t next_id;
+	uint32_t bad;
+	uint32_t reordered;
+};
+
+static struct result *res;
+static struct cobs_decoder dec;
+static uint8_t dec_buf[2 * MAX_MESSAGE_SIZE];
+
+static void frame_cb(void *arg, uint8_t *data, size_t len)
+{
+	uint32_t id, t;
+
+	if ((len < 3 + 8) || dec.crc || (data[0] != MSG_IP_PACKET)) {
+		if (len && !dec.crc && (data[0] != MSG_IP_PACKET))
+			return; // control message
+		res->bad++;
+		return;
+	}
+	memcpy(&id, data + 1, 4);
+	memcpy(&t, data + 5, 4);
+	if (id < res->next_id)
+		res->reordered++;
+	res->next_id = id + 1;
+	res->delay[res->n++] = (uint32_t)sim_now() - t;
+}
+
+static void tx_byte(uint8_t c)
+{
+	cobs_decoder_put(&dec, &c, 1);
+}
+
+static uint32_t rd32(const uint8_t *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static bool load_pcap(const char *path)
+{
+	uint8_t hdr[24], rec[16];
+	uint64_t t0 = 0;
+	bool swap, nsec;
+	uint32_t magic;
+	FILE *f = fopen(path, "rb");
+
+	if (!f || (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))) {
+		printf("  can't read %s\n", path);
+		return false;
+	}
+	memcpy(&magic, hdr, 4);
+	swap = (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1);
+	nsec = (magic == 0xa1b23c4d) || (magic == 0x4d3cb2a1);
+	if (!swap && !nsec && (magic != 0xa1b2c3d4)) {
+		printf("  %s is not a pcap file\n", path);
+		fclose(f);
+		return false;
+	}
+
+	while ((trace_n < MAX_PKTS) &&
+	       (fread(rec, 1, sizeof(rec), f) == sizeof(rec))) {
+		uint32_t incl = rd32(rec + 8, swap);
+		uint32_t orig = rd32(rec + 12, swap);
+		uint64_t t = rd32(rec, swap) * 1000000ULL +
+		             rd32(rec + 4, swap) / (nsec ? 1000 : 1);
+
+		if (fseek(f, incl, SEEK_CUR))
+			break;
+		if (!trace_n)
+			t0 = t;
+		trace[trace_n].t = t - t0;
+		trace[trace_n].len = orig < MIN_LEN ? MIN_LEN :
+		                     orig > MAX_PACKET_SIZE ? MAX_PACKET_SIZE :
+		                     orig;
+		trace_n++;
+	}
+	fclose(f);
+	printf("  %s: %d packets\n", path, (int)trace_n);
+	return trace_n > 0;
+}
+
+// On/off bursts: 1 s at 1.5x line rate, 1 s at 0.4x, longer than
+// interval so CoDel gets to act. Mostly 512 byte packets with some small
+// ones.
+static void make_trace(void)
+{
+	uint64_t t = 0;
+
+	while ((t < 20000000) && (trace_n < MAX_PKTS)) {
+		bool on = (t / 1000000) % 2 == 0;
+		uint16_t len = (test_rand() % 5) ? 512 : 60;
+		uint64_t gap = (uint64_t)len * 1000000 /
+			(on ? BYTES_PER_SEC * 3 / 2 : BYTES_PER_SEC * 2 / 5);
+
+		trace[trace_n].t = t;
+		trace[trace_n].len = len;
+		trace_n++;
+		t += gap / 2 + test_rand() % (gap + 1);
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(struct result *r, int p)
+{
+	return r->n ? r->delay[(r->n - 1) * p / 100] : 0;
+}
+
+static void replay(struct result *r, bool aqm, struct comm_tx_queue_stats *qs)
+{
+	static uint8_t pkt[MAX_PACKET_SIZE];
+	struct comm_stats st;
+	size_t i;
+
+	memset(r, 0, sizeof(*r));
+	r->delay = malloc(trace_n * sizeof(*r->delay));
+	res = r;
+
+	sim_init(BAUD, tx_byte);
+	cobs_decoder_init(&dec, dec_buf, sizeof(dec_buf), frame_cb, NULL);
+	comm_init(NULL);
+	CHECK(comm_set_tx_aqm(COMM_TX_PRIO_LOW, aqm ? AQM_TARGET : 0,
+	                      aqm ? AQM_INTERVAL : 0));
+
+	memset(pkt, 0x5a, sizeof(pkt));
+	for (i = 0; i < trace_n; i++) {
+		uint32_t id = i, t;
+
+		if (trace[i].t > sim_now())
+			sim_advance(trace[i].t - sim_now());
+		t = sim_now();
+		memcpy(pkt, &id, 4);
+		memcpy(pkt + 4, &t, 4);
+		comm_send(MSG_IP_PACKET, pkt, trace[i].len, COMM_TX_PRIO_LOW);
+	}
+	sim_advance(2000000);
+
+	comm_get_stats(&st);
+	*qs = st.tx_queues[COMM_TX_PRIO_LOW];
+	qsort(r->delay, r->n, sizeof(*r->delay), cmp_u32);
+}
+
+int main(int argc, char **argv)
+{
+	struct result tail, codel;
+	struct comm_tx_queue_stats qs_tail, qs_codel;
+
+	if (argc > 1) {
+		if (!load_pcap(argv[1]))
+			return 1;
+	} else {
+		make_trace();
+	}
+
+	replay(&tail, false, &qs_tail);
+	replay(&codel, true, &qs_codel);
+
+	printf("  %d packets at %d baud, delay ms p50/p90/p99/max\n",
+	       (int)trace_n, BAUD);
+	printf("  tail drop: %4d/%4d/%4d/%4d  delivered %d, dropped %d\n",
+	       percentile(&tail, 50) / 1000, percentile(&tail, 90) / 1000,
+	       percentile(&tail, 99) / 1000, percentile(&tail, 100) / 1000,
+	       (int)tail.n, (int)qs_tail.dropped);
+	printf("  codel:     %4d/%4d/%4d/%4d  delivered %d, dropped %d + "
+	       "aqm %d\n",
+	       percentile(&codel, 50) / 1000, percentile(&codel, 90) / 1000,
+	       percentile(&codel, 99) / 1000, percentile(&codel, 100) / 1000,
+	       (int)codel.n, (int)qs_codel.dropped, (int)qs_codel.aqm_dropped);
+
+	CHECK_EQ(tail.bad, 0);
+	CHECK_EQ(codel.bad, 0);
+	CHECK_EQ(tail.reordered, 0);
+	CHECK_EQ(codel.reordered, 0);
+	CHECK_EQ(qs_tail.aqm_dropped, 0);
+	CHECK_EQ(tail.n + qs_tail.dropped, trace_n);
+	CHECK_EQ(codel.n + qs_codel.dropped + qs_codel.aqm_dropped, trace_n);
+	if (argc == 1) {
+		// synthetic trace overloads the line
+		CHECK(qs_tail.dropped > 0);
+		CHECK(qs_codel.aqm_dropped > 0);
+		CHECK(percentile(&codel, 90) < percentile(&tail, 90));
+		CHECK(percentile(&codel, 99) < percentile(&tail, 99));
+	}
+
+	free(tail.delay);
+	free(codel.delay);
+	return test_result("test_codel");
+}
@@ -0,0 +1,366 @@
+/* Packet filter: programs as `tcpdump -dd` prints them run on Ethernet
+   frames, some split over pbufs, and must give the same verdict libpcap
+   would. Validator must reject bad programs and keep the loaded one.
+   Counters of accepted, truncated and dropped frames and hits of each
+   ret are checked too. */
+#include <string.h>
+
+#include "test.h"
+#include "filter.h"
+#include "comm.h"
+#include "misc.h"
+
+#define TCP_SNAPLEN 0x40000
+#define UDP_SNAPLEN 96
+
+// comm.c is not linked, errors are only counted
+uint8_t comm_loglevel = 40;
+static int errors;
+
+void comm_send_ctl(uint8_t type, void *data, size_t n)
+{
+	if (type == MSG_LOG)
+		errors++;
+}
+
+// tcpdump -dd tcp port 80
+static const struct filter_insn tcp_port_80[] = {
+	{ 0x28, 0, 0, 0x0000000c },
+	{ 0x15, 0, 6, 0x000086dd },
+	{ 0x30, 0, 0, 0x00000014 },
+	{ 0x15, 0, 15, 0x00000006 },
+	{ 0x28, 0, 0, 0x00000036 },
+	{ 0x15, 12, 0, 0x00000050 },
+	{ 0x28, 0, 0, 0x00000038 },
+	{ 0x15, 10, 11, 0x00000050 },
+	{ 0x15, 0, 10, 0x00000800 },
+	{ 0x30, 0, 0, 0x00000017 },
+	{ 0x15, 0, 8, 0x00000006 },
+	{ 0x28, 0, 0, 0x00000014 },
+	{ 0x45, 6, 0, 0x00001fff },
+	{ 0xb1, 0, 0, 0x0000000e },
+	{ 0x48, 0, 0, 0x0000000e },
+	{ 0x15, 2, 0, 0x00000050 },
+	{ 0x48, 0, 0, 0x00000010 },
+	{ 0x15, 0, 1, 0x00000050 },
+	{ 0x6, 0, 0, 0x00040000 },
+	{ 0x6, 0, 0, 0x00000000 },
+};
+
+// tcpdump -dd -s 96 udp
+static const struct filter_insn udp_96[] = {
+	{ 0x28, 0, 0, 0x0000000c },
+	{ 0x15, 0, 5, 0x000086dd },
+	{ 0x30, 0, 0, 0x00000014 },
+	{ 0x15, 6, 0, 0x00000011 },
+	{ 0x15, 0, 6, 0x0000002c },
+	{ 0x30, 0, 0, 0x00000036 },
+	{ 0x15, 3, 4, 0x00000011 },
+	{ 0x15, 0, 3, 0x00000800 },
+	{ 0x30, 0, 0, 0x00000017 },
+	{ 0x15, 0, 1, 0x00000011 },
+	{ 0x6, 0, 0, 0x00000060 },
+	{ 0x6, 0, 0, 0x00000000 },
+};
+
+// Not what libpcap emits: scratch memory, ALU and division by X.
+// Returns (len - k) * 2 / (byte 14 & 0xf), k given in mem[0].
+static const struct filter_insn arith[] = {
+	{ 0x00, 0, 0, 10 },         // ld #10
+	{ 0x02, 0, 0, 0 },          // st M[0]
+	{ 0x80, 0, 0, 0 },          // ld len
+	{ 0x61, 0, 0, 0 },          // ldx M[0]
+	{ 0x1c, 0, 0, 0 },          // sub x
+	{ 0x24, 0, 0, 2 },          // mul #2
+	{ 0x02, 0, 0, 1 },          // st M[1]
+	{ 0x30, 0, 0, 14 },         // ldb [14]
+	{ 0x54, 0, 0, 0xf },        // and #0xf
+	{ 0x07, 0, 0, 0 },          // tax
+	{ 0x60, 0, 0, 1 },          // ld M[1]
+	{ 0x3c, 0, 0, 0 },          // div x
+	{ 0x16, 0, 0, 0 },          // ret a
+};
+
+static uint8_t frame[1600];
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+// Ethernet + IPv4 or IPv6 + TCP/UDP header + payload, returns length
+static size_t make_frame(bool v6, uint8_t proto, uint16_t sport,
+                         uint16_t dport, size_t payload_len)
+{
+	uint8_t *ip = frame + 14, *l4;
+	size_t l4_len = (proto == 6 ? 20 : 8) + payload_len;
+
+	memset(frame, 0, sizeof(frame));
+	memset(frame, 0xff, 6);
+	if (v6) {
+		put16(frame + 12, 0x86dd);
+		ip[0] = 0x60;
+		put16(ip + 4, l4_len);
+		ip[6] = proto;
+		ip[7] = 64;
+		l4 = ip + 40;
+	} else {
+		put16(frame + 12, 0x0800);
+		ip[0] = 0x45;
+		put16(ip + 2, 20 + l4_len);
+		ip[8] = 64;
+		ip[9] = proto;
+		l4 = ip + 20;
+	}
+	put16(l4, sport);
+	put16(l4 + 2, dport);
+	if (proto == 6)
+		l4[12] = 5 << 4;
+	else
+		put16(l4 + 4, l4_len);
+	return l4 - frame + l4_len;
+}
+
+// Runs the filter on frame, as one pbuf or split at `split`
+static uint32_t run(size_t len, size_t split)
+{
+	struct pbuf p[2];
+
+	memset(p, 0, sizeof(p));
+	p[0].payload = frame;
+	p[0].len = p[0].tot_len = len;
+	if (split && (split < len)) {
+		p[0].len = split;
+		p[0].next = &p[1];
+		p[1].payload = frame + split;
+		p[1].len = p[1].tot_len = len - split;
+	}
+	return filter_run(&p[0]);
+}
+
+static void test_validator(void)
+{
+	struct filter_insn prog[FILTER_MAX_INSNS + 1];
+	struct filter_stats st;
+	size_t i;
+
+	CHECK(filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80)));
+	errors = 0;
+
+	for (i = 0; i < ARRAY_SIZE(prog); i++)
+		prog[i] = (struct filter_insn){ 0x6, 0, 0, 0 };
+	CHECK(!filter_set(prog, FILTER_MAX_INSNS + 1));
+	CHECK(filter_set(prog, FILTER_MAX_INSNS));
+	CHECK(filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80)));
+
+	// jumps past the end
+	memcpy(prog, tcp_port_80, sizeof(tcp_port_80));
+	prog[3].jf = 16;
+	CHECK(!filter_set(prog, ARRAY_SIZE(tcp_port_80)));
+	prog[3].jf = 15;
+	prog[17].jt = 2;
+	CHECK(!filter_set(prog, ARRAY_SIZE(tcp_port_80)));
+	prog[17].jt = 0;
+	prog[0] = (struct filter_insn){ 0x05, 0, 0, 19 }; // ja
+	CHECK(!filter_set(prog, ARRAY_SIZE(tcp_port_80)));
+	prog[0].k = 18;
+	CHECK(filter_set(prog, ARRAY_SIZE(tcp_port_80)));
+	CHECK(filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80)));
+
+	// doesn't end with ret
+	CHECK(!filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80) - 2));
+
+	// division by constant zero, scratch memory out of range, unknown
+	// opcodes
+	prog[0] = (struct filter_insn){ 0x34, 0, 0, 0 }; // div #0
+	prog[1] = (struct filter_insn){ 0x6, 0, 0, 0 };
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x94, 0, 0, 0 }; // mod #0
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x02, 0, 0, 16 }; // st M[16]
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x60, 0, 0, 16 }; // ld M[16]
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x60, 0, 0, 15 };
+	CHECK(filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0xc4, 0, 0, 0 }; // not a valid alu op
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x55, 0, 0, 0 }; // no such jump
+	CHECK(!filter_set(prog, 2));
+	prog[0] = (struct filter_insn){ 0x0e, 0, 0, 0 }; // ret x
+	CHECK(!filter_set(prog, 1));
+
+	CHECK_EQ(errors, 12);
+
+	// previous program stays
+	CHECK(filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80)));
+	CHECK(!filter_set(prog, 1));
+	filter_get_stats(&st);
+	CHECK_EQ(st.len, ARRAY_SIZE(tcp_port_80));
+	CHECK_EQ(run(make_frame(false, 17, 1000, 80, 10), 0), 0);
+}
+
+static void test_tcp_port(void)
+{
+	struct filter_stats st;
+	size_t len;
+
+	CHECK(filter_set(tcp_port_80, ARRAY_SIZE(tcp_port_80)));
+
+	len = make_frame(false, 6, 40000, 80, 100);
+	CHECK_EQ(run(len, 0), TCP_SNAPLEN);
+	// headers cut in the middle of loaded fields
+	CHECK_EQ(run(len, 15), TCP_SNAPLEN);
+	CHECK_EQ(run(len, 35), TCP_SNAPLEN);
+	CHECK_EQ(run(len, 37), TCP_SNAPLEN);
+	len = make_frame(false, 6, 80, 40000, 0);
+	CHECK_EQ(run(len, 0), TCP_SNAPLEN);
+	len = make_frame(true, 6, 40000, 80, 100);
+	CHECK_EQ(run(len, 0), TCP_SNAPLEN);
+	CHECK_EQ(run(len, 55), TCP_SNAPLEN);
+
+	len = make_frame(false, 6, 40000, 443, 100);
+	CHECK_EQ(run(len, 0), 0);
+	len = make_frame(false, 17, 40000, 80, 100);
+	CHECK_EQ(run(len, 0), 0);
+	len = make_frame(true, 17, 80, 80, 100);
+	CHECK_EQ(run(len, 0), 0);
+
+	// non-first fragment has no ports
+	len = make_frame(false, 6, 40000, 80, 100);
+	put16(frame + 14 + 6, 185);
+	CHECK_EQ(run(len, 0), 0);
+
+	// IP options move TCP header, ports are found through X
+	len = make_frame(false, 6, 40000, 80, 100);
+	memmove(frame + 14 + 24, frame + 14 + 20, len - 34);
+	memset(frame + 14 + 20, 1, 4); // NOPs
+	frame[14] = 0x46;
+	CHECK_EQ(run(len + 4, 0), TCP_SNAPLEN);
+	CHECK_EQ(run(len + 4, 50), TCP_SNAPLEN);
+
+	// truncated frame fails the port load and is dropped
+	make_frame(false, 6, 40000, 80, 0);
+	CHECK_EQ(run(36, 0), 0);
+
+	filter_get_stats(&st);
+	CHECK_EQ(st.len, ARRAY_SIZE(tcp_port_80));
+	CHECK_EQ(st.accepted, 9);
+	CHECK_EQ(st.truncated, 0);
+	CHECK_EQ(st.dropped, 5);
+	CHECK_EQ(st.hits[18], 9);
+	// dropped by failed load don't reach a ret
+	CHECK_EQ(st.hits[19], 4);
+}
+
+static void test_snaplen(void)
+{
+	struct filter_stats st;
+	size_t len;
+
+	CHECK(filter_set(udp_96, ARRAY_SIZE(udp_96)));
+	filter_get_stats(&st);
+	CHECK_EQ(st.accepted + st.truncated + st.dropped, 0);
+	CHECK_EQ(st.hits[18], 0);
+
+	len = make_frame(false, 17, 5353, 5353, 1000);
+	CHECK_EQ(run(len, 0), UDP_SNAPLEN);
+	CHECK_EQ(run(len, 20), UDP_SNAPLEN);
+	len = make_frame(true, 17, 5353, 5353, 1000);
+	CHECK_EQ(run(len, 0), UDP_SNAPLEN);
+	len = make_frame(false, 17, 53, 53, 10);
+	CHECK(len < UDP_SNAPLEN);
+	CHECK_EQ(run(len, 0), UDP_SNAPLEN);
+	len = make_frame(false, 6, 53, 53, 10);
+	CHECK_EQ(run(len, 0), 0);
+	// ARP
+	put16(frame + 12, 0x0806);
+	CHECK_EQ(run(60, 0), 0);
+
+	filter_get_stats(&st);
+	CHECK_EQ(st.truncated, 3);
+	CHECK_EQ(st.accepted, 1);
+	CHECK_EQ(st.dropped, 2);
+	CHECK_EQ(st.hits[10], 4);
+	CHECK_EQ(st.hits[11], 2);
+}
+
+static void test_arith(void)
+{
+	struct filter_stats st;
+	size_t len;
+
+	CHECK(filter_set(arith, ARRAY_SIZE(arith)));
+	len = make_frame(false, 17, 1, 2, 100);
+	CHECK_EQ(frame[14] & 0xf, 5);
+	CHECK_EQ(run(len, 0), (len - 10) * 2 / 5);
+	// division by zero in X drops the frame
+	frame[14] = 0x40;
+	CHECK_EQ(run(len, 0), 0);
+
+	filter_get_stats(&st);
+	CHECK_EQ(st.accepted, 0);
+	CHECK_EQ(st.truncated, 1);
+	CHECK_EQ(st.dropped, 1);
+	CHECK_EQ(st.hits[ARRAY_SIZE(arith) - 1], 1);
+}
+
+// Loads of scratch memory never stored read zero, whatever is on stack
+static const struct filter_insn mem_unset[] = {
+	{ 0x60, 0, 0, 0 },          // ld M[0]
+	{ 0x61, 0, 0, 15 },         // ldx M[15]
+	{ 0x4c, 0, 0, 0 },          // or x
+	{ 0x04, 0, 0, 64 },         // add #64
+	{ 0x16, 0, 0, 0 },          // ret a
+};
+
+static void dirty_stack(void)
+{
+	volatile uint8_t junk[512];
+	size_t i;
+
+	for (i = 0; i < sizeof(junk); i++)
+		junk[i] = 0xa5;
+}
+
+static void test_mem_unset(void)
+{
+	struct filter_stats st;
+	size_t len;
+
+	CHECK(filter_set(mem_unset, ARRAY_SIZE(mem_unset)));
+	len = make_frame(false, 17, 1, 2, 100);
+	dirty_stack();
+	CHECK_EQ(run(len, 0), 64);
+	// values stored by the previous run don't leak either
+	CHECK(filter_set(arith, ARRAY_SIZE(arith)));
+	CHECK(run(len, 0) > 0);
+	CHECK(filter_set(mem_unset, ARRAY_SIZE(mem_unset)));
+	CHECK_EQ(run(len, 0), 64);
+
+	filter_get_stats(&st);
+	CHECK_EQ(st.truncated, 1);
+}
+
+int main(void)
+{
+	struct filter_stats st;
+
+	CHECK_EQ(run(make_frame(false, 6, 1, 2, 0), 0), FILTER_ACCEPT_ALL);
+
+	test_validator();
+	test_tcp_port();
+	test_snaplen();
+	test_arith();
+	test_mem_unset();
+
+	// empty program removes the filter
+	CHECK(filter_set(NULL, 0));
+	CHECK_EQ(run(make_frame(false, 6, 1, 2, 0), 0), FILTER_ACCEPT_ALL);
+	filter_get_stats(&st);
+	CHECK_EQ(st.len, 0);
+	CHECK_EQ(st.accepted + st.truncated + st.dropped, 0);
+
+	return test_result("test_filter");
+}
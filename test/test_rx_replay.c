@@ -0,0 +1,215 @@
+/* Rx path: replays a byte stream through a model of the uart receive
+   path in comm.c. Bytes land in the 128 byte hw fifo at line rate, the
+   interrupt handler moves them into the rx ring (receiver_fill()) and the
+   comm task, which runs after a random scheduling delay, feeds the ring to
+   the COBS decoder in contiguous chunks (do_rx()). While the ring is full
+   the interrupt stays disabled and bytes pile up in hw fifo, bytes that
+   don't fit there are lost and counted as overruns.
+
+   Checks that jitter the ring is sized for loses nothing, and that with
+   larger jitter overruns are counted and the decoder resyncs without
+   passing corrupted frames. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "cobs.h"
+#include "crc16.h"
+
+#define RX_RING_SIZE 4096 /* as in comm.c */
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+#define HW_FIFO_SIZE 128
+#define RX_FIFO_THRESHOLD 16 /* bytes in fifo that raise interrupt */
+#define BYTE_TIME_NS 5000 /* 2 Mbaud, 10 bits per byte */
+
+#define N_FRAMES 4000
+#define MAX_FRAME 1600
+
+struct stream {
+	uint8_t *data;
+	size_t len;
+};
+
+struct sim {
+	uint8_t ring[RX_RING_SIZE];
+	uint32_t read_i, write_i;
+	uint32_t fifo;       /* bytes waiting in hw fifo */
+	uint32_t overruns;   /* bytes lost */
+	bool stalled;        /* ring was full, interrupt disabled */
+	bool task_pending;
+	uint64_t task_at;    /* ns, when pending task runs */
+	uint64_t max_jitter; /* ns */
+};
+
+struct rx {
+	struct cobs_decoder dec;
+	uint8_t buf[MAX_FRAME + 8];
+	uint32_t next;   /* index of the next frame expected */
+	uint32_t good;   /* frames with valid crc and content */
+	uint32_t bad;    /* frames with valid crc but unexpected content */
+	uint32_t crc_errors;
+};
+
+static struct rx rx;
+
+static void frame_cb(void *arg, uint8_t *data, size_t len)
+{
+	uint32_t idx;
+
+	if ((len < 6) || rx.dec.crc) {
+		rx.crc_errors++;
+		return;
+	}
+
+	/* frame starts with its index, frames may be lost but not reordered */
+	memcpy(&idx, data, sizeof(idx));
+	if (idx < rx.next) {
+		rx.bad++;
+		return;
+	}
+	rx.next = idx + 1;
+	rx.good++;
+}
+
+/* Stream of N_FRAMES frames: index, random payload, crc, COBS framing */
+static void make_stream(struct stream *s)
+{
+	static uint8_t plain[MAX_FRAME + 2];
+	size_t cap = N_FRAMES * (COBS_ENCODED_MAX_SIZE(MAX_FRAME + 2) + 1);
+	uint32_t i;
+
+	s->data = malloc(cap);
+	s->len = 0;
+	for (i = 0; i < N_FRAMES; i++) {
+		size_t len = 4 + test_rand() % (MAX_FRAME - 4);
+		size_t j;
+		uint16_t crc;
+
+		memcpy(plain, &i, sizeof(i));
+		for (j = 4; j < len; j++)
+			plain[j] = (test_rand() % 16) ? test_rand() : 0;
+		crc = crc16_block(plain, len);
+		plain[len] = crc & 0xff;
+		plain[len + 1] = crc >> 8;
+		s->len += cobs_encode(s->data + s->len, plain, len + 2);
+	}
+}
+
+static void post_task(struct sim *sim, uint64_t now)
+{
+	if (sim->task_pending)
+		return;
+	sim->task_pending = true;
+	sim->task_at = now + (uint64_t)test_rand() % (sim->max_jitter + 1);
+}
+
+/* receiver_fill() */
+static void isr(struct sim *sim, const uint8_t *fifo_data, uint64_t now)
+{
+	uint32_t ring_free = RX_RING_SIZE - (sim->write_i - sim->read_i);
+	uint32_t n = sim->fifo < ring_free ? sim->fifo : ring_free;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		sim->ring[sim->write_i++ & RX_RING_MASK] = fifo_data[i];
+	sim->fifo -= n;
+	if (sim->fifo)
+		sim->stalled = true;
+	post_task(sim, now);
+}
+
+/* do_rx() */
+static void task(struct sim *sim)
+{
+	sim->task_pending = false;
+	while (sim->read_i != sim->write_i) {
+		uint32_t off = sim->read_i & RX_RING_MASK;
+		uint32_t n = sim->write_i - sim->read_i;
+
+		if (n > RX_RING_SIZE - off)
+			n = RX_RING_SIZE - off;
+		cobs_decoder_put(&rx.dec, sim->ring + off, n);
+		sim->read_i += n;
+	}
+	sim->stalled = false;
+}
+
+/* Interrupt takes bytes from the front of hw fifo */
+static void fifo_isr(struct sim *sim, uint8_t *fifo_data, uint64_t now)
+{
+	uint32_t before = sim->fifo;
+
+	isr(sim, fifo_data, now);
+	memmove(fifo_data, fifo_data + (before - sim->fifo), sim->fifo);
+}
+
+static void replay(const struct stream *s, struct sim *sim)
+{
+	uint8_t fifo_data[HW_FIFO_SIZE];
+	uint64_t now = 0;
+	size_t i;
+
+	memset(&rx, 0, sizeof(rx));
+	cobs_decoder_init(&rx.dec, rx.buf, sizeof(rx.buf), frame_cb, NULL);
+
+	for (i = 0; i < s->len; i++) {
+		now += BYTE_TIME_NS;
+
+		if (sim->task_pending && (now >= sim->task_at)) {
+			task(sim);
+			/* interrupt is enabled again, fifo is drained at once */
+			if (sim->fifo)
+				fifo_isr(sim, fifo_data, now);
+		}
+
+		if (sim->fifo == HW_FIFO_SIZE) {
+			sim->overruns++;
+			continue;
+		}
+		fifo_data[sim->fifo++] = s->data[i];
+
+		if (!sim->stalled && (sim->fifo >= RX_FIFO_THRESHOLD))
+			fifo_isr(sim, fifo_data, now);
+	}
+
+	/* line is idle: rx timeout interrupt and final task runs */
+	while (sim->fifo || sim->task_pending) {
+		fifo_isr(sim, fifo_data, now);
+		task(sim);
+	}
+}
+
+int main(void)
+{
+	static struct sim sim;
+	struct stream s;
+
+	make_stream(&s);
+
+	/* Ring holds ~20 ms at 2 Mbaud, 10 ms of task latency is fine */
+	memset(&sim, 0, sizeof(sim));
+	sim.max_jitter = 10000000;
+	replay(&s, &sim);
+	CHECK_EQ(sim.overruns, 0);
+	CHECK_EQ(rx.good, N_FRAMES);
+	CHECK_EQ(rx.crc_errors, 0);
+	CHECK_EQ(rx.bad, 0);
+	printf("  jitter 10 ms: overruns %d, frames %d/%d\n",
+	       (int)sim.overruns, (int)rx.good, N_FRAMES);
+
+	/* Task held off for up to 50 ms: data is lost, loss is counted and
+	   only frames that made it through intact are delivered */
+	memset(&sim, 0, sizeof(sim));
+	sim.max_jitter = 50000000;
+	replay(&s, &sim);
+	CHECK(sim.overruns > 0);
+	CHECK(rx.good > 0);
+	CHECK(rx.good < N_FRAMES);
+	CHECK_EQ(rx.bad, 0);
+	printf("  jitter 50 ms: overruns %d, frames %d/%d, crc errors %d\n",
+	       (int)sim.overruns, (int)rx.good, N_FRAMES,
+	       (int)rx.crc_errors);
+
+	free(s.data);
+	return test_result("test_rx_replay");
+}
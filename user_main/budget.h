@@ -0,0 +1,39 @@
+#pragma once
+#include "c_types.h"
+
+// Byte budget of a buffer pool: every allocation is charged and every free
+// is credited, so admission is a single compare instead of asking heap
+// allocator. Not interrupt safe, callers that share a budget with an
+// interrupt handler must lock around it.
+struct budget {
+	uint32_t limit;
+	uint32_t used;
+	uint32_t peak;   // highest `used` seen
+	uint32_t denied; // number of refused allocations
+};
+
+static inline void budget_init(struct budget *b, uint32_t limit)
+{
+	b->limit = limit;
+	b->used = 0;
+	b->peak = 0;
+	b->denied = 0;
+}
+
+static inline bool budget_take(struct budget *b, uint32_t n)
+{
+	if (b->limit - b->used < n) {
+		b->denied++;
+		return false;
+	}
+
+	b->used += n;
+	if (b->used > b->peak)
+		b->peak = b->used;
+	return true;
+}
+
+static inline void budget_give(struct budget *b, uint32_t n)
+{
+	b->used -= n;
+}
@@ -0,0 +1,268 @@
+#include "osapi.h"
+#include "c_types.h"
+
+#include "clamp.h"
+#include "comm.h"
+#include "misc.h"
+
+#define ETH_HDR_LEN 14
+#define ETHTYPE_IP 0x0800
+#define PROTO_TCP 6
+
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+#define TCPOPT_WS 3
+
+// Window is clamped to what uart drains in one RTT of the flow, so remote
+// sender doesn't put more in flight than the link to host can take before
+// transmitter starts tail-dropping. Window scaling is stripped from SYNs
+// in both directions while clamping is on, so window field is in bytes.
+// RTT is set by host (it has the estimates), drain rate follows baud rate.
+//
+// MSS announced in SYNs crossing an interface is lowered to the configured
+// value in both directions, so segments of either side fit tunnels on the
+// path and the frames to host stay below MAX_PACKET_SIZE.
+static uint32_t drain_rate = 115200 / 10;
+static uint32_t window_rtt_ms = 0;
+static struct clamp_stats stats;
+
+
+static void ICACHE_FLASH_ATTR
+update_window(void)
+{
+	uint32_t w;
+
+	if (!window_rtt_ms) {
+		stats.window = 0;
+		return;
+	}
+
+	// fits 32 bits for CLAMP_MAX_RTT at any uart baud rate
+	w = drain_rate * window_rtt_ms / 1000;
+	if (w < CLAMP_MIN_WINDOW)
+		w = CLAMP_MIN_WINDOW;
+	if (w > 0xffff)
+		w = 0xffff;
+	stats.window = w;
+}
+
+void ICACHE_FLASH_ATTR
+clamp_set_drain_rate(uint32_t bytes_per_sec)
+{
+	drain_rate = bytes_per_sec;
+	update_window();
+}
+
+// rtt_us == 0 disables window clamping
+bool ICACHE_FLASH_ATTR
+clamp_set_window_rtt(uint32_t rtt_us)
+{
+	if (rtt_us > CLAMP_MAX_RTT) {
+		COMM_ERR("RTT is too long: %d us", (int)rtt_us);
+		return false;
+	}
+
+	window_rtt_ms = (rtt_us + 999) / 1000;
+	update_window();
+	return true;
+}
+
+// mss == 0 disables clamping on interface
+bool ICACHE_FLASH_ATTR
+clamp_set_mss(int if_index, uint32_t mss)
+{
+	if ((if_index < 0) || (if_index >= CLAMP_IF_N)) {
+		COMM_ERR("Bad interface: %d", if_index);
+		return false;
+	}
+	if ((mss && (mss < CLAMP_MIN_MSS)) || (mss > 0xffff)) {
+		COMM_ERR("Bad MSS: %d", (int)mss);
+		return false;
+	}
+
+	stats.mss[if_index] = mss;
+	return true;
+}
+
+
+// Incremental checksum update for a 16-bit word changed from old to new
+// (RFC 1624, eqn. 3), checksum is in network order.
+static void ICACHE_FLASH_ATTR
+csum_replace(uint8_t *csum, uint16_t old, uint16_t new)
+{
+	uint32_t sum = (uint16_t)~((csum[0] << 8) | csum[1]);
+
+	sum += (uint16_t)~old;
+	sum += new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	csum[0] = sum >> 8;
+	csum[1] = sum & 0xff;
+}
+
+// Sets byte of TCP header and fixes checksum. Words are counted from the
+// start of TCP header, which is at even offset in the checksummed data.
+static void ICACHE_FLASH_ATTR
+tcp_set_byte(uint8_t *tcp, size_t off, uint8_t v)
+{
+	uint8_t *w = tcp + (off & ~1);
+	uint16_t old = (w[0] << 8) | w[1];
+
+	tcp[off] = v;
+	csum_replace(tcp + 16, old, (w[0] << 8) | w[1]);
+}
+
+static void ICACHE_FLASH_ATTR
+tcp_set_word(uint8_t *tcp, size_t off, uint16_t v)
+{
+	uint16_t old = (tcp[off] << 8) | tcp[off + 1];
+
+	tcp[off] = v >> 8;
+	tcp[off + 1] = v & 0xff;
+	csum_replace(tcp + 16, old, v);
+}
+
+// Returns TCP header of IPv4 packet if whole of it is in the first pbuf
+// segment, NULL otherwise. Header length is stored to hl.
+static uint8_t * ICACHE_FLASH_ATTR
+tcp_header(struct pbuf *p, bool ether, size_t *hl)
+{
+	uint8_t *b = p->payload;
+	size_t n = p->len;
+	size_t ip_hl;
+
+	if (ether) {
+		if ((n < ETH_HDR_LEN) ||
+		    (((b[12] << 8) | b[13]) != ETHTYPE_IP))
+			return NULL;
+		b += ETH_HDR_LEN;
+		n -= ETH_HDR_LEN;
+	}
+
+	if ((n < 20) || ((b[0] >> 4) != 4) || (b[9] != PROTO_TCP))
+		return NULL;
+	// non-first fragment has no TCP header
+	if (((b[6] & 0x1f) << 8) | b[7])
+		return NULL;
+
+	ip_hl = 4 * (b[0] & 0xf);
+	if ((ip_hl < 20) || (n < ip_hl + 20)) {
+		stats.skipped++;
+		return NULL;
+	}
+	b += ip_hl;
+	n -= ip_hl;
+
+	*hl = 4 * (b[12] >> 4);
+	if ((*hl < 20) || (*hl > n)) {
+		stats.skipped++;
+		return NULL;
+	}
+	return b;
+}
+
+// Rewrites options of a SYN: window scale is replaced by NOPs if
+// strip_ws is set, MSS is lowered to mss if it's non-zero. Returns true if
+// MSS was lowered.
+static bool ICACHE_FLASH_ATTR
+fix_syn_options(uint8_t *tcp, size_t hl, bool strip_ws, uint32_t mss)
+{
+	bool clamped = false;
+	size_t i = 20;
+
+	while (i < hl) {
+		uint8_t kind = tcp[i];
+		size_t len;
+
+		if (kind == TCPOPT_EOL)
+			break;
+		if (kind == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= hl)
+			break;
+		len = tcp[i + 1];
+		if ((len < 2) || (i + len > hl))
+			break;
+
+		if (strip_ws && (kind == TCPOPT_WS) && (len == 3)) {
+			tcp_set_byte(tcp, i, TCPOPT_NOP);
+			tcp_set_byte(tcp, i + 1, TCPOPT_NOP);
+			tcp_set_byte(tcp, i + 2, TCPOPT_NOP);
+			stats.ws_removed++;
+		}
+		// option may start at odd offset, so it's set bytewise
+		if (mss && (kind == TCPOPT_MSS) && (len == 4) &&
+		    (((tcp[i + 2] << 8) | tcp[i + 3]) > mss)) {
+			tcp_set_byte(tcp, i + 2, mss >> 8);
+			tcp_set_byte(tcp, i + 3, mss & 0xff);
+			clamped = true;
+		}
+		i += len;
+	}
+	return clamped;
+}
+
+static uint32_t ICACHE_FLASH_ATTR
+if_mss(int if_index)
+{
+	if ((if_index < 0) || (if_index >= CLAMP_IF_N))
+		return 0;
+	return stats.mss[if_index];
+}
+
+// Packet from host going to WLan through interface if_index, -1 if unknown
+void ICACHE_FLASH_ATTR
+clamp_output(struct pbuf *p, bool ether, int if_index)
+{
+	uint32_t mss = if_mss(if_index);
+	uint8_t *tcp;
+	size_t hl;
+	uint16_t win;
+
+	if (!stats.window && !mss)
+		return;
+	tcp = tcp_header(p, ether, &hl);
+	if (!tcp || (tcp[13] & TCP_RST))
+		return;
+
+	if ((tcp[13] & TCP_SYN) &&
+	    fix_syn_options(tcp, hl, stats.window != 0, mss))
+		stats.mss_clamped_out[if_index]++;
+
+	win = (tcp[14] << 8) | tcp[15];
+	if (stats.window && (win > stats.window)) {
+		tcp_set_word(tcp, 14, stats.window);
+		stats.windows_clamped++;
+	}
+}
+
+// Packet from WLan received on interface if_index going to host. Remote's
+// window scale option is removed too, otherwise host would scale windows
+// it advertises.
+void ICACHE_FLASH_ATTR
+clamp_input(struct pbuf *p, bool ether, int if_index)
+{
+	uint32_t mss = if_mss(if_index);
+	uint8_t *tcp;
+	size_t hl;
+
+	if (!stats.window && !mss)
+		return;
+	tcp = tcp_header(p, ether, &hl);
+	if (tcp && (tcp[13] & TCP_SYN) &&
+	    fix_syn_options(tcp, hl, stats.window != 0, mss))
+		stats.mss_clamped_in[if_index]++;
+}
+
+void ICACHE_FLASH_ATTR
+clamp_get_stats(struct clamp_stats *st)
+{
+	*st = stats;
+}
@@ -0,0 +1,33 @@
+#ifndef CLAMP_H
+#define CLAMP_H
+#include "c_types.h"
+#include "lwip/pbuf.h"
+
+// Smallest window advertised while clamping, two full-sized segments
+#define CLAMP_MIN_WINDOW 2920
+// Longest RTT accepted for window clamping
+#define CLAMP_MAX_RTT 5000000 // us
+// Smallest MSS accepted for clamping, IPv4 and TCP headers with options
+// still leave some payload
+#define CLAMP_MIN_MSS 88
+// Interfaces MSS is clamped on, indexed by STATION_IF and SOFTAP_IF
+#define CLAMP_IF_N 2
+
+struct clamp_stats {
+	uint32_t window;          // current clamp in bytes, 0 if disabled
+	uint32_t windows_clamped; // ACKs from host with window lowered
+	uint32_t ws_removed;      // window scale options replaced by NOPs
+	uint32_t skipped;         // TCP headers not in first pbuf segment
+	uint32_t mss[CLAMP_IF_N]; // current MSS clamp, 0 if disabled
+	uint32_t mss_clamped_in[CLAMP_IF_N];  // SYNs from WLan
+	uint32_t mss_clamped_out[CLAMP_IF_N]; // SYNs from host
+};
+
+void clamp_set_drain_rate(uint32_t bytes_per_sec);
+bool clamp_set_window_rtt(uint32_t rtt_us);
+bool clamp_set_mss(int if_index, uint32_t mss);
+void clamp_output(struct pbuf *p, bool ether, int if_index);
+void clamp_input(struct pbuf *p, bool ether, int if_index);
+void clamp_get_stats(struct clamp_stats *);
+
+#endif
@@ -0,0 +1,228 @@
+#include "osapi.h"
+#include "c_types.h"
+
+#include "classify.h"
+#include "comm.h"
+#include "misc.h"
+
+#define ETH_HDR_LEN 14
+#define ETHTYPE_IP 0x0800
+#define ETHTYPE_IPV6 0x86dd
+
+#define PROTO_ICMP 1
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+#define PROTO_ICMPV6 58
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+
+// CS5 (video), EF (voice), CS6 and CS7 (network control)
+#define DSCP_PRIO_MIN 40
+
+// Enough for IPv4 header with options and TCP header with timestamps
+#define PARSE_MAX (ETH_HDR_LEN + 60 + 32)
+
+static struct msg_prio_port port_rules[CLASSIFY_MAX_PORT_RULES] = {
+	{ PROTO_UDP, COMM_TX_PRIO_MEDIUM, 53, 53 }, // DNS
+};
+static uint32_t port_rules_n = 1;
+
+static struct classify_stats stats;
+
+
+// Returns false if headers are truncated or malformed. Ethernet frames
+// that don't carry IP are parsed successfully, with ip_version 0.
+bool ICACHE_FLASH_ATTR
+classify_parse(struct pbuf *p, bool ether, struct pkt_info *pi)
+{
+	uint8_t tmp[PARSE_MAX];
+	const uint8_t *b, *l4;
+	uint32_t n, hl, l4_len;
+
+	os_memset(pi, 0, sizeof(*pi));
+
+	// Headers are in the first segment almost always, copy only if not
+	n = MIN(p->tot_len, ether ? PARSE_MAX : PARSE_MAX - ETH_HDR_LEN);
+	if (p->len >= n) {
+		b = p->payload;
+	} else {
+		pbuf_copy_partial(p, tmp, n, 0);
+		b = tmp;
+	}
+
+	if (ether) {
+		uint16_t type;
+		if (n < ETH_HDR_LEN)
+			return false;
+		type = (b[12] << 8) | b[13];
+		if ((type != ETHTYPE_IP) && (type != ETHTYPE_IPV6))
+			return true;
+		b += ETH_HDR_LEN;
+		n -= ETH_HDR_LEN;
+	}
+
+	if (!n)
+		return false;
+	pi->ip_version = b[0] >> 4;
+
+	if (pi->ip_version == 4) {
+		hl = 4 * (b[0] & 0xf);
+		if ((n < 20) || (hl < 20) || (hl > n))
+			return false;
+		pi->dscp = b[1] >> 2;
+		pi->proto = b[9];
+		os_memcpy(&pi->src, b + 12, 4);
+		os_memcpy(&pi->dst, b + 16, 4);
+		// non-first fragment has no transport header
+		if (((b[6] & 0x1f) << 8) | b[7])
+			return true;
+		l4_len = (b[2] << 8) | b[3];
+		if (l4_len < hl)
+			return false;
+		l4_len -= hl;
+	} else if (pi->ip_version == 6) {
+		// extension headers are not followed
+		hl = 40;
+		if (n < hl)
+			return false;
+		pi->dscp = (((b[0] & 0xf) << 4) | (b[1] >> 4)) >> 2;
+		pi->proto = b[6];
+		l4_len = (b[4] << 8) | b[5];
+	} else {
+		pi->ip_version = 0;
+		return false;
+	}
+
+	l4 = b + hl;
+	n -= hl;
+	switch (pi->proto) {
+	case PROTO_TCP:
+		if (n < 14)
+			return false;
+		hl = 4 * (l4[12] >> 4);
+		pi->tcp_flags = l4[13];
+		pi->payload_len = l4_len > hl ? l4_len - hl : 0;
+		pi->ack = (l4[8] << 24) | (l4[9] << 16) | (l4[10] << 8) | l4[11];
+		// Plain ACK, optionally with timestamps (NOP, NOP, TS), is
+		// superseded by a later one. SACK or other options aren't.
+		pi->ack_only = (pi->ip_version == 4) &&
+			(pi->tcp_flags == TCP_ACK) && (hl == l4_len) &&
+			((hl == 20) || ((hl == 32) && (n >= 24) &&
+			                (l4[20] == 1) && (l4[21] == 1) &&
+			                (l4[22] == 8) && (l4[23] == 10)));
+		break;
+	case PROTO_UDP:
+		if (n < 8)
+			return false;
+		pi->payload_len = l4_len > 8 ? l4_len - 8 : 0;
+		break;
+	case PROTO_ICMP:
+	case PROTO_ICMPV6:
+		if (n < 1)
+			return false;
+		pi->icmp_type = l4[0];
+		return true;
+	default:
+		return true;
+	}
+
+	pi->sport = (l4[0] << 8) | l4[1];
+	pi->dport = (l4[2] << 8) | l4[3];
+	return true;
+}
+
+// Sets class of the packet and returns its tx priority. Tests go from the
+// most specific, first match wins.
+size_t ICACHE_FLASH_ATTR
+classify(struct pkt_info *pi)
+{
+	size_t i;
+
+	if (!pi->ip_version) {
+		pi->class = PKT_CLASS_NON_IP;
+		return COMM_TX_PRIO_MEDIUM;
+	}
+
+	if (pi->proto == PROTO_TCP) {
+		if (pi->tcp_flags & (TCP_SYN | TCP_FIN | TCP_RST)) {
+			pi->class = PKT_CLASS_TCP_CTRL;
+			return COMM_TX_PRIO_MEDIUM;
+		}
+		if (!pi->payload_len) {
+			pi->class = PKT_CLASS_ACK;
+			return COMM_TX_PRIO_MEDIUM;
+		}
+	}
+
+	if ((pi->proto == PROTO_TCP) || (pi->proto == PROTO_UDP)) {
+		for (i = 0; i < port_rules_n; i++) {
+			struct msg_prio_port *r = &port_rules[i];
+			if (r->proto && (r->proto != pi->proto))
+				continue;
+			if (((pi->sport >= r->port_lo) &&
+			     (pi->sport <= r->port_hi)) ||
+			    ((pi->dport >= r->port_lo) &&
+			     (pi->dport <= r->port_hi))) {
+				pi->class = PKT_CLASS_PORT;
+				return r->prio;
+			}
+		}
+	}
+
+	if (pi->dscp >= DSCP_PRIO_MIN) {
+		pi->class = PKT_CLASS_DSCP;
+		return COMM_TX_PRIO_MEDIUM;
+	}
+
+	if ((pi->proto == PROTO_ICMP) || (pi->proto == PROTO_ICMPV6)) {
+		pi->class = PKT_CLASS_ICMP;
+		return COMM_TX_PRIO_MEDIUM;
+	}
+
+	pi->class = PKT_CLASS_BULK;
+	return COMM_TX_PRIO_LOW;
+}
+
+void ICACHE_FLASH_ATTR
+classify_count(const struct pkt_info *pi, bool queued)
+{
+	if (queued)
+		stats.queued[pi->class]++;
+	else
+		stats.dropped[pi->class]++;
+}
+
+bool ICACHE_FLASH_ATTR
+classify_set_ports(const struct msg_prio_port *rules, size_t n)
+{
+	size_t i;
+
+	if (n > CLASSIFY_MAX_PORT_RULES) {
+		COMM_ERR("Too many port rules: %d", (int)n);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct msg_prio_port *r = &rules[i];
+		if (((r->proto != 0) && (r->proto != PROTO_TCP) &&
+		     (r->proto != PROTO_UDP)) ||
+		    (r->prio > COMM_TX_PRIO_MEDIUM) ||
+		    (r->port_lo > r->port_hi)) {
+			COMM_ERR("Bad port rule %d", (int)i);
+			return false;
+		}
+	}
+
+	os_memcpy(port_rules, rules, n * sizeof(*rules));
+	port_rules_n = n;
+	return true;
+}
+
+void ICACHE_FLASH_ATTR
+classify_get_stats(struct classify_stats *st)
+{
+	*st = stats;
+}
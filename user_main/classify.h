@@ -0,0 +1,50 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+#include "c_types.h"
+#include "lwip/pbuf.h"
+#include "message.h"
+
+#define CLASSIFY_MAX_PORT_RULES 8
+
+enum pkt_class {
+	PKT_CLASS_BULK = 0,
+	PKT_CLASS_TCP_CTRL, // SYN, FIN or RST
+	PKT_CLASS_ACK,      // TCP without payload
+	PKT_CLASS_PORT,     // matched host-configured port rule
+	PKT_CLASS_DSCP,     // DSCP CS5 and above, including EF
+	PKT_CLASS_ICMP,
+	PKT_CLASS_NON_IP,   // ARP, EAPOL, etc.
+	PKT_CLASS_N
+};
+
+// Headers of a received frame, parsed once and shared by steering,
+// filtering and classification. Addresses are in network order, ports in
+// host order. Fields of layers that are not present are zero.
+struct pkt_info {
+	uint8_t ip_version; // 0 if not IP
+	uint8_t proto;
+	uint8_t dscp;
+	uint8_t tcp_flags;
+	uint8_t icmp_type;
+	uint8_t class;
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t payload_len; // TCP/UDP payload
+	uint32_t ack;         // TCP ack number
+	bool ack_only;        // IPv4 TCP ACK that a newer one makes redundant
+	uint32_t src; // IPv4 only
+	uint32_t dst;
+};
+
+struct classify_stats {
+	uint32_t queued[PKT_CLASS_N];
+	uint32_t dropped[PKT_CLASS_N];
+};
+
+bool classify_parse(struct pbuf *p, bool ether, struct pkt_info *pi);
+size_t classify(struct pkt_info *pi);
+void classify_count(const struct pkt_info *pi, bool queued);
+bool classify_set_ports(const struct msg_prio_port *rules, size_t n);
+void classify_get_stats(struct classify_stats *);
+
+#endif
@@ -1,6 +1,16 @@
 #include <inttypes.h>
 #include <string.h>
 #include "cobs.h"
+#include "crc16.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+typedef uint32_t __attribute__((__may_alias__)) cobs_word_t;
+
+// True if any byte of the word is zero
+#define COBS_HAS_ZERO(w) (((w) - 0x01010101UL) & ~(w) & 0x80808080UL)
 
 
 size_t cobs_encode(uint8_t *dst_orig, uint8_t *src_orig, size_t src_len)
@@ -52,55 +62,251 @@ size_t cobs_encode(uint8_t *dst_orig, uint8_t *src_orig, size_t src_len)
 }
 
 
+void cobs_encoder_init(struct cobs_encoder *enc, uint8_t *buf, uint32_t mask,
+		       uint32_t pos)
+{
+	enc->buf = buf;
+	enc->mask = mask;
+	enc->code_pos = pos;
+	enc->pos = pos + 1;
+	enc->code_len = 0x01;
+}
+
+void cobs_encoder_put(struct cobs_encoder *enc, uint8_t const *src, size_t len)
+{
+	uint8_t *buf = enc->buf;
+	uint32_t mask = enc->mask;
+	uint32_t pos = enc->pos;
+	uint32_t code_pos = enc->code_pos;
+	uint8_t code_len = enc->code_len;
+
+	while (len--) {
+		uint8_t ch = *src++;
+
+		// Full block is closed only when more data arrives, so that
+		// a frame ending on block boundary doesn't get an extra code
+		// byte (same output as cobs_encode()).
+		if (code_len == 0xFF) {
+			buf[code_pos & mask] = code_len;
+			code_pos = pos++;
+			code_len = 0x01;
+		}
+
+		if (ch == COBS_BYTE_EOF) {
+			buf[code_pos & mask] = code_len;
+			code_pos = pos++;
+			code_len = 0x01;
+		} else {
+			buf[pos++ & mask] = ch;
+			code_len++;
+		}
+	}
+
+	enc->pos = pos;
+	enc->code_pos = code_pos;
+	enc->code_len = code_len;
+}
+
+/* Same as cobs_encoder_put(), but also updates crc16 of the data in the
+   same pass. Aligned groups of 4 non-zero bytes are loaded and checksummed
+   as a single word (little-endian byte order is assumed). */
+void cobs_encoder_put_crc(struct cobs_encoder *enc, uint8_t const *src,
+			  size_t len, uint16_t *crc_p)
+{
+	uint8_t *buf = enc->buf;
+	uint32_t mask = enc->mask;
+	uint32_t pos = enc->pos;
+	uint32_t code_pos = enc->code_pos;
+	uint8_t code_len = enc->code_len;
+	uint16_t crc = *crc_p;
+
+	while (len) {
+		if ((len >= 4) && !((uintptr_t)src & 3) && (code_len <= 0xFF - 4)) {
+			uint32_t w = *(cobs_word_t const *)src;
+
+			if (!COBS_HAS_ZERO(w)) {
+				crc16_update_word(&crc, w);
+				buf[pos++ & mask] = w;
+				buf[pos++ & mask] = w >> 8;
+				buf[pos++ & mask] = w >> 16;
+				buf[pos++ & mask] = w >> 24;
+				code_len += 4;
+				src += 4;
+				len -= 4;
+				continue;
+			}
+		}
+
+		uint8_t ch = *src++;
+		len--;
+		crc16_update(&crc, ch);
+
+		if (code_len == 0xFF) {
+			buf[code_pos & mask] = code_len;
+			code_pos = pos++;
+			code_len = 0x01;
+		}
+
+		if (ch == COBS_BYTE_EOF) {
+			buf[code_pos & mask] = code_len;
+			code_pos = pos++;
+			code_len = 0x01;
+		} else {
+			buf[pos++ & mask] = ch;
+			code_len++;
+		}
+	}
+
+	enc->pos = pos;
+	enc->code_pos = code_pos;
+	enc->code_len = code_len;
+	*crc_p = crc;
+}
+
+/* Closes the last block and appends frame delimiter. Returns position
+   right after the delimiter. */
+uint32_t cobs_encoder_finish(struct cobs_encoder *enc)
+{
+	enc->buf[enc->code_pos & enc->mask] = enc->code_len;
+	enc->buf[enc->pos++ & enc->mask] = COBS_BYTE_EOF;
+	return enc->pos;
+}
+
+
 void cobs_decoder_init(struct cobs_decoder *cobs, uint8_t *buf, size_t buf_size,
 		       cobs_callback_t cb, void *cb_data)
 {
   cobs->state = DEC_IDLE;
   cobs->buf = buf;
   cobs->buf_size = buf_size;
+  cobs->base = buf;
+  cobs->base_size = buf_size;
+  cobs->split = 0;
+  cobs->split_cb = NULL;
+  cobs->stop = 0;
   cobs->cb = cb;
   cobs->cb_data = cb_data;
 }
 
-/* FIXME: check logic if cnt = 0xff */
-void cobs_decoder_put(struct cobs_decoder *cobs, uint8_t const *src, size_t len)
+void cobs_decoder_set_split(struct cobs_decoder *cobs, size_t split,
+			    cobs_callback_t split_cb)
 {
-	while (len--) {
-		uint16_t ch;
+  cobs->split = split;
+  cobs->split_cb = split_cb;
+}
 
-		ch = *src++;
+/* Only valid from split callback */
+void cobs_decoder_redirect(struct cobs_decoder *cobs, uint8_t *buf, size_t size)
+{
+  cobs->buf = buf;
+  cobs->buf_size = size;
+  cobs->buf_ind = 0;
+  cobs->redirected = 1;
+}
+
+/* Only valid from frame callback. cobs_decoder_put() returns right after
+   delimiter of the frame, the rest of data is left to the caller. */
+void cobs_decoder_stop(struct cobs_decoder *cobs)
+{
+  cobs->stop = 1;
+}
+
+static inline void
+cobs_decoder_emit(struct cobs_decoder *cobs, uint8_t const *src, size_t n)
+{
+	uint8_t *dst = cobs->buf + cobs->buf_ind;
+	uint16_t crc = cobs->crc;
+	size_t i;
+
+	if (n > cobs->buf_size - cobs->buf_ind) {
+		cobs->overflow = 1;
+		n = cobs->buf_size - cobs->buf_ind;
+	}
+
+	memcpy(dst, src, n);
+	for (i = 0; i < n; i++)
+		crc16_update(&crc, dst[i]);
 
-		switch (cobs->state) {
-		case DEC_IDLE:
+	cobs->buf_ind += n;
+	cobs->crc = crc;
+
+	if (cobs->split_pending && (cobs->buf_ind == cobs->split)) {
+		cobs->split_pending = 0;
+		cobs->split_cb(cobs->cb_data, cobs->buf, cobs->buf_ind);
+	}
+}
+
+/* Data bytes of a block are copied as a whole run, state is examined only
+   on code bytes. Block of length 0xFF isn't followed by an implicit zero.
+   Returns number of bytes consumed, less than len only if decoder was
+   stopped. */
+size_t cobs_decoder_put(struct cobs_decoder *cobs, uint8_t const *src, size_t len)
+{
+	static const uint8_t zero = COBS_BYTE_EOF;
+	uint8_t const *start = src;
+	uint8_t const *end = src + len;
+	uint8_t ch;
+
+	while (src < end) {
+		if (cobs->state == DEC_IDLE) {
+			ch = *src++;
 			if (ch != COBS_BYTE_EOF) {
+				cobs->buf = cobs->base;
+				cobs->buf_size = cobs->base_size;
 				cobs->buf_ind = 0;
 				cobs->overflow = 0;
-				cobs->block_cnt = cobs->block_len = ch;
+				cobs->split_pending =
+					cobs->split && cobs->split_cb;
+				cobs->redirected = 0;
+				cobs->crc = CRC16_INIT_VALUE;
+				cobs->block_len = ch;
+				cobs->block_cnt = ch - 1;
 				cobs->state = DEC_BLOCK;
 			}
-			break;
+			continue;
+		}
 
-		case DEC_BLOCK:
-			if (ch != COBS_BYTE_EOF) {
-				if ((cobs->block_cnt == 1) && (cobs->block_len < 0xFF)) {
-					cobs->buf[cobs->buf_ind++] = COBS_BYTE_EOF;
-					cobs->block_cnt = cobs->block_len = ch;
-				} else if ((cobs->block_cnt == 1) && (cobs->block_len == 0xff)) {
-					cobs->block_cnt = cobs->block_len = ch;
-				} else {
-					cobs->block_cnt--;
-					if (cobs->buf_ind < cobs->buf_size)
-						cobs->buf[cobs->buf_ind++] = ch;
-					else
-						cobs->overflow = 1; // TODO: report error?
-				}
-			} else {
-				if ((cobs->block_cnt == 1) && (cobs->overflow == 0))
-					cobs->cb(cobs->cb_data, cobs->buf, cobs->buf_ind);
-				cobs->buf_ind = 0;
+		if (cobs->block_cnt) {
+			size_t n = MIN(cobs->block_cnt, (size_t)(end - src));
+			uint8_t const *eof;
+
+			// stop at split point, so callback can redirect output
+			if (cobs->split_pending)
+				n = MIN(n, cobs->split - cobs->buf_ind);
+
+			eof = memchr(src, COBS_BYTE_EOF, n);
+
+			if (eof) {
+				// truncated frame, resync on this delimiter
+				src = eof + 1;
 				cobs->state = DEC_IDLE;
+				continue;
 			}
-			break;
+
+			cobs_decoder_emit(cobs, src, n);
+			cobs->block_cnt -= n;
+			src += n;
+			continue;
+		}
+
+		ch = *src++;
+		if (ch == COBS_BYTE_EOF) {
+			if (!cobs->overflow) {
+				cobs->eof_off = src - start;
+				cobs->cb(cobs->cb_data, cobs->buf, cobs->buf_ind);
+			}
+			cobs->state = DEC_IDLE;
+			if (cobs->stop) {
+				cobs->stop = 0;
+				return src - start;
+			}
+		} else {
+			if (cobs->block_len != 0xFF)
+				cobs_decoder_emit(cobs, &zero, 1);
+			cobs->block_len = ch;
+			cobs->block_cnt = ch - 1;
 		}
 	}
+
+	return len;
 }
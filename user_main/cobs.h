@@ -13,6 +13,25 @@
 size_t cobs_encode(uint8_t *, uint8_t *, size_t);
 
 
+/* Streaming encoder. Output is written into a ring buffer of (mask + 1)
+   bytes starting at free-running position `pos', so a frame may be built
+   from several chunks and may wrap around the end of the buffer. Caller
+   is responsible for reserving COBS_ENCODED_MAX_SIZE() + 1 bytes. */
+struct cobs_encoder
+{
+  uint8_t *buf;
+  uint32_t mask;
+  uint32_t pos;
+  uint32_t code_pos;
+  uint8_t code_len;
+};
+
+void cobs_encoder_init(struct cobs_encoder *, uint8_t *, uint32_t mask, uint32_t pos);
+void cobs_encoder_put(struct cobs_encoder *, uint8_t const *, size_t len);
+void cobs_encoder_put_crc(struct cobs_encoder *, uint8_t const *, size_t len, uint16_t *crc);
+uint32_t cobs_encoder_finish(struct cobs_encoder *);
+
+
 enum cobs_decoder_state
 {
   DEC_IDLE = 0,
@@ -28,16 +47,41 @@ struct cobs_decoder
   uint32_t buf_ind;
   uint8_t overflow;
 
-  uint32_t block_len;
-  uint32_t block_cnt;
+  /* Every frame starts in base buffer. When `split' bytes are decoded,
+     split_cb is called with them and may move the rest of the frame into
+     another buffer with cobs_decoder_redirect(). Callback then gets only
+     the part after split. */
+  uint8_t *base;
+  uint32_t base_size;
+  uint32_t split;
+  uint8_t split_pending;
+  uint8_t redirected;
+  cobs_callback_t split_cb;
+
+  uint32_t block_len; /* code byte of current block */
+  uint32_t block_cnt; /* data bytes left in current block */
   enum cobs_decoder_state state;
 
+  /* crc16 of decoded data, updated on the fly. If frame ends with its
+     own crc (LE), it's zero for a valid frame. */
+  uint16_t crc;
+
+  /* offset of the byte following delimiter of dispatched frame within data
+     passed to cobs_decoder_put(), valid in callback */
+  uint32_t eof_off;
+
+  /* set by cobs_decoder_stop() */
+  uint8_t stop;
+
   cobs_callback_t cb;
   void *cb_data;
 };
 
 void cobs_decoder_init(struct cobs_decoder *, uint8_t *, size_t, cobs_callback_t cb, void *cb_data);
-void cobs_decoder_put(struct cobs_decoder *, uint8_t const *, size_t len);
+size_t cobs_decoder_put(struct cobs_decoder *, uint8_t const *, size_t len);
+void cobs_decoder_set_split(struct cobs_decoder *, size_t split, cobs_callback_t split_cb);
+void cobs_decoder_redirect(struct cobs_decoder *, uint8_t *, size_t);
+void cobs_decoder_stop(struct cobs_decoder *);
 
 
 #endif
@@ -1,14 +1,3 @@
-/* TODO:
- *  - dump rx data from interrupt handler into ring buffer first.
- *
- *  - using preallocated "flat" tx buffer with size around 8-16KB
- *    would be more efficient than malloc-ing packets all the time,
- *    and it'd also make mem fragmentation impossible.
- *    It'd also make impossible to reorder packets, but we don't do
- *    it anyway. It'd also require modified COBS encoder that writes
- *    directly into buffer.
- */
-
 #include "osapi.h"
 #include "eagle_soc.h"
 #include "c_types.h"
@@ -22,6 +11,7 @@
 #include "misc.h"
 #include "cobs.h"
 #include "crc16.h"
+#include "budget.h"
 
 #define COMM_TASK_PRIO USER_TASK_PRIO_0
 
@@ -33,235 +23,1346 @@
 
 // Shift beginnig of the buffer so payload is aligned.
 // This way message headers can be cast to structure directly.
-#define BUF_ALIGN_OFFSET (__BIGGEST_ALIGNMENT__ - 1)
+#define BUF_ALIGN __BIGGEST_ALIGNMENT__
+
+
+// Interrupts are disabled only for short bookkeeping. Longest such section
+// and longest run of interrupt handler are tracked, both delay draining of
+// uart rx fifo.
+static uint32_t intr_off_start;
+static uint32_t intr_off_max;
+static uint32_t isr_max;
+
+static inline void
+comm_intr_lock(void)
+{
+	ets_intr_lock();
+	intr_off_start = get_ccount();
+}
+
+static inline void
+comm_intr_unlock(void)
+{
+	uint32_t cycles = get_ccount() - intr_off_start;
+
+	if (cycles > intr_off_max)
+		intr_off_max = cycles;
+	ets_intr_unlock();
+}
 
 
 /* ------------------------------------------------------------------ send */
 
-#define TX_RING_BUFFER_SIZE 32
-#define TX_RING_BUFFER_MASK (TX_RING_BUFFER_SIZE - 1)
+// Every priority has its own queue, so bulk data can delay a control message
+// by at most one frame that is already on the wire. Encoded frames are
+// written straight into a flat byte ring ("arena") of the queue, so tx path
+// doesn't allocate anything and can't fragment heap. Frame boundaries and
+// enqueue times are kept in a ring of descriptors. Indices are free-running
+// and wrapped with masks on access.
+#define TX_QUEUES 3
+
+#define TX_ARENA_SIZE_LOW    4096
+#define TX_ARENA_SIZE_MEDIUM 2048
+#define TX_ARENA_SIZE_HIGH   2048
+
+// Tx interrupt fires when fifo holds less than this many bytes. It should
+// cover interrupt latency, otherwise line goes idle between refills.
+#define TX_FIFO_THRESHOLD 32
+
+#define TX_DESC_SLOTS 32
+#define TX_DESC_MASK (TX_DESC_SLOTS - 1)
+
+// Time a frame spent in queue is collected into log2 histogram: bucket i
+// counts frames that waited less than 2^i us.
+#define TX_LATENCY_BUCKETS 24
+
+// CoDel (RFC 8289) on queue sojourn time, applied when a frame is taken
+// for sending, so it runs in interrupt handler. Control messages are never
+// dropped. Disabled by default: at low baud rates a single frame takes
+// longer than any sensible target, so host enables it with targets that
+// fit the link.
+// Interval is limited so interval << 8 fits in 32 bits
+#define CODEL_MAX_INTERVAL (1 << 24)
+
+struct codel {
+	uint32_t target;   // us, acceptable standing queue delay
+	uint32_t interval; // us, 0 if disabled
+	uint32_t first_above; // time delay went above target plus interval
+	uint32_t drop_next;
+	uint32_t count;
+	uint32_t last_count;
+	bool dropping;
+};
+
+struct tx_desc {
+	uint32_t start;
+	uint32_t end;
+	uint32_t time; // system_get_time() at enqueue
+	bool dead; // superseded by a newer frame, skipped by sender
+};
+
+struct tx_queue {
+	uint8_t *arena;
+	uint32_t mask;
+	volatile uint32_t read_i;  // next byte to be sent
+	uint32_t reserve_i;        // end of reserved space
+	uint32_t reserve_n;        // number of reservations not committed yet
+
+	struct tx_desc desc[TX_DESC_SLOTS];
+	volatile uint32_t desc_read_i;  // frame being sent or next one
+	volatile uint32_t desc_write_i; // end of committed frames
+	uint32_t desc_reserve_i;
+
+	// configured with MSG_SET_TX_QUEUE
+	uint32_t max_frames;
+	uint32_t max_bytes;
+	uint32_t weight;
+	uint32_t passed_over; // frames of higher queues sent while we waited
+
+	struct codel codel;
+
+	uint32_t frames;
+	uint32_t dropped;
+	uint32_t aqm_dropped;
+	uint32_t discarded; // encoded with old header when framing changed
+	uint32_t latency[TX_LATENCY_BUCKETS];
+};
 
 struct transmitter {
-	uint8_t *bufs[TX_RING_BUFFER_SIZE];
-	size_t   buf_lens[TX_RING_BUFFER_SIZE];
-	volatile uint16_t buf_read_i;
-	volatile uint16_t buf_write_i;
+	struct tx_queue q[TX_QUEUES];
+	int cur; // queue whose frame is being sent, -1 if none
+	struct budget budget; // bytes held by all queues
+
+	uint32_t push_n;
+	uint32_t push_cycles; // total and max cost of transmitter_pushv()
+	uint32_t push_cycles_max;
 
 	volatile bool task_pending;
+	bool streaming;      // tx interrupt is enabled because data is queued
+	uint32_t bytes;      // total bytes written to fifo
+	uint32_t fifo_idle;  // fifo was found empty while streaming
 	uint32_t dropped_packets;
-	size_t idx_in_buf;
+	bool flow_ctrl;      // fifo is gated by CTS
+	uint32_t cts_stalls; // fifo was full because host deasserted CTS
+
+	uint32_t acks_replaced; // queued ACK overwritten by a newer one
+	uint32_t acks_dropped;  // queued ACK marked dead, newer one queued
+	uint32_t ack_bytes_saved;
 };
 
 struct transmitter transmitter_uart0;
 
+uint8_t tx_arena_low[TX_ARENA_SIZE_LOW];
+uint8_t tx_arena_medium[TX_ARENA_SIZE_MEDIUM];
+uint8_t tx_arena_high[TX_ARENA_SIZE_HIGH];
+
+static void comm_flush_batch(void);
+
+
+static void ICACHE_FLASH_ATTR
+tx_queue_reset_stats(struct tx_queue *q)
+{
+	size_t i;
+
+	q->frames = 0;
+	q->dropped = 0;
+	q->aqm_dropped = 0;
+	q->discarded = 0;
+	for (i = 0; i < TX_LATENCY_BUCKETS; i++)
+		q->latency[i] = 0;
+}
+
+
+static void ICACHE_FLASH_ATTR
+tx_queue_init(struct tx_queue *q, uint8_t *arena, size_t size)
+{
+	q->arena = arena;
+	q->mask = size - 1;
+	q->read_i = 0;
+	q->reserve_i = 0;
+	q->reserve_n = 0;
+	q->desc_read_i = 0;
+	q->desc_write_i = 0;
+	q->desc_reserve_i = 0;
+	q->max_frames = TX_DESC_SLOTS;
+	q->max_bytes = size;
+	q->weight = 0;
+	q->passed_over = 0;
+	os_memset(&q->codel, 0, sizeof(q->codel));
+	tx_queue_reset_stats(q);
+}
+
+
+// Returns upper bound of the histogram bucket holding given percentile of
+// queueing latency, in us. Zero if nothing was sent yet.
+static uint32_t ICACHE_FLASH_ATTR
+tx_queue_latency(struct tx_queue *q, uint32_t percent)
+{
+	uint32_t total = 0;
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < TX_LATENCY_BUCKETS; i++)
+		total += q->latency[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < TX_LATENCY_BUCKETS; i++) {
+		sum += q->latency[i];
+		if ((uint64_t)sum * 100 >= (uint64_t)total * percent)
+			break;
+	}
+	return 1 << MIN(i, TX_LATENCY_BUCKETS - 1);
+}
+
 
 static void ICACHE_FLASH_ATTR
 transmitter_init(struct transmitter *t)
 {
-	t->buf_read_i = 0;
-	t->buf_write_i = 0;
-	t->idx_in_buf = 0;
+	tx_queue_init(&t->q[COMM_TX_PRIO_LOW],
+	              tx_arena_low, sizeof(tx_arena_low));
+	tx_queue_init(&t->q[COMM_TX_PRIO_MEDIUM],
+	              tx_arena_medium, sizeof(tx_arena_medium));
+	tx_queue_init(&t->q[COMM_TX_PRIO_HIGH],
+	              tx_arena_high, sizeof(tx_arena_high));
+	t->cur = -1;
+	budget_init(&t->budget, sizeof(tx_arena_low) +
+	            sizeof(tx_arena_medium) + sizeof(tx_arena_high));
+	t->push_n = 0;
+	t->push_cycles = 0;
+	t->push_cycles_max = 0;
 	t->task_pending = false;
+	t->streaming = false;
+	t->bytes = 0;
+	t->fifo_idle = 0;
 	t->dropped_packets = 0;
+	t->flow_ctrl = false;
+	t->cts_stalls = 0;
+	t->acks_replaced = 0;
+	t->acks_dropped = 0;
+	t->ack_bytes_saved = 0;
 }
 
 
+// Called from interrupt handler.
 static void transmitter_wake_task(struct transmitter *t)
 {
 	// We don't want to put a lot of messages into task queue since it's
 	// quite small. So we use a flag to tell if we've already put task into
 	// queue and it's not dispatched yet.
-	if (t->task_pending)
-		return;
-
-	ets_intr_lock();
 	if (!t->task_pending) {
 		t->task_pending = true;
 		system_os_post(COMM_TASK_PRIO, DO_TX, 0);
 	}
-	ets_intr_unlock();
 }
 
 
-// This function can be called from different contexts. It disables
-// interrupts in the critical section.
+// Fifo is filled by interrupt handler. Enabling tx interrupt is enough to
+// start it, it fires right away if fifo is below threshold.
 static void ICACHE_FLASH_ATTR
-transmitter_push(struct transmitter *t, uint8_t *data, size_t len, size_t prio)
-{
-	// precheck if we'll queue packet
-	size_t buf_used = t->buf_write_i - t->buf_read_i;
-	if (buf_used == TX_RING_BUFFER_SIZE)
-		goto drop;
-
-	size_t buf_free = TX_RING_BUFFER_SIZE - buf_used;
-	size_t heap_free = system_get_free_heap_size(); // PERF: how much does it cost?
-
-	switch (prio) {
-	case COMM_TX_PRIO_LOW:
-		if ((heap_free < 20000) || (buf_free < 15)) goto drop; break;
-	case COMM_TX_PRIO_MEDIUM:
-		if ((heap_free < 10000) || (buf_free < 10)) goto drop; break;
-	case COMM_TX_PRIO_HIGH:
-		if ((heap_free <  2000) || (buf_free <  1)) goto drop; break;
-	default:;
-	}
-
-	// prepare data
-	size_t encoded_max_size = COBS_ENCODED_MAX_SIZE(len) + 1;
-	uint8_t *encoded = os_malloc(encoded_max_size);
-	if (!encoded)
-		return;
+transmitter_kick(struct transmitter *t)
+{
+	uint32 status = READ_PERI_REG(UART_STATUS(0));
+	uint32 fifo_cnt = (status >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+
+	// With hw flow control fifo isn't drained while CTS is inactive.
+	// Without it CTS line is ignored (and may be left floating), full
+	// fifo is just a busy line.
+	if (t->flow_ctrl && (fifo_cnt >= 126) && (status & UART_CTSN))
+		t->cts_stalls++;
+
+	comm_intr_lock();
+	uart0_tx_intr_enable();
+	comm_intr_unlock();
+}
+
+
+static void ICACHE_FLASH_ATTR
+transmitter_idle(struct transmitter *t)
+{
+	comm_intr_lock();
+	t->task_pending = false;
+	comm_intr_unlock();
 
-	encoded[encoded_max_size - 1] = 0x55;
-	size_t encoded_size = cobs_encode(encoded, data, len);
-	if (encoded[encoded_max_size - 1] != 0x55) {
-		COMM_ERR("buffer overflow");
+	comm_flush_batch();
+}
+
+
+// Reserves n bytes of queue arena and a descriptor. Frame is encoded into
+// reserved space outside of critical section and then published with
+// transmitter_commit().
+static bool ICACHE_FLASH_ATTR
+transmitter_reserve(struct transmitter *t, struct tx_queue *q, size_t n,
+                    uint32_t *desc_i)
+{
+	comm_intr_lock();
+	if ((q->reserve_i - q->read_i + n > q->max_bytes) ||
+	    (q->desc_reserve_i - q->desc_read_i >= q->max_frames) ||
+	    !budget_take(&t->budget, n)) {
+		q->dropped++;
+		comm_intr_unlock();
+		return false;
 	}
 
-	// put into ring buffer
-	ets_intr_lock();
-	if (t->buf_write_i - t->buf_read_i == TX_RING_BUFFER_SIZE) {
-		ets_intr_unlock();
-		os_free(encoded);
-		goto drop;
+	struct tx_desc *d = &q->desc[q->desc_reserve_i & TX_DESC_MASK];
+	d->start = q->reserve_i;
+	d->end = q->reserve_i + n;
+	d->dead = false;
+	*desc_i = q->desc_reserve_i++;
+	q->reserve_i += n;
+	q->reserve_n++;
+	comm_intr_unlock();
+	return true;
+}
+
+
+// Frames are published in order of reservation: desc_write_i is advanced
+// only when there are no outstanding reservations (e.g. one made from
+// interrupt while task was encoding its frame). Unused tail of reservation
+// is returned if nobody has reserved after us, otherwise sender just skips
+// it.
+static void ICACHE_FLASH_ATTR
+transmitter_commit(struct transmitter *t, struct tx_queue *q, uint32_t desc_i,
+                   uint32_t end)
+{
+	struct tx_desc *d = &q->desc[desc_i & TX_DESC_MASK];
+
+	comm_intr_lock();
+	if (q->reserve_i == d->end) {
+		q->reserve_i = end;
+		budget_give(&t->budget, d->end - end);
 	}
+	d->end = end;
+	d->time = system_get_time();
 
-	size_t i = t->buf_write_i & TX_RING_BUFFER_MASK;
-	t->bufs[i] = encoded;
-	t->buf_lens[i] = encoded_size;
-	t->buf_write_i++;
-	ets_intr_unlock();
+	if (--q->reserve_n == 0)
+		q->desc_write_i = q->desc_reserve_i;
+	comm_intr_unlock();
+}
 
-	transmitter_wake_task(t);
-	return;
 
- drop:
-	t->dropped_packets += 1;
+// Message is assembled from header (type byte and optional framing fields),
+// data segments and crc while being encoded, no intermediate copies are made.
+// Returns end position of encoded frame.
+static uint32_t ICACHE_FLASH_ATTR
+tx_encode(uint8_t *buf, uint32_t mask, uint32_t pos,
+          const uint8_t *hdr, size_t hdr_len,
+          const struct comm_iovec *iov, size_t iovcnt)
+{
+	struct cobs_encoder enc;
+	uint16_t crc;
+	uint8_t crc_buf[2];
+	size_t i;
+
+	cobs_encoder_init(&enc, buf, mask, pos);
+
+	crc = CRC16_INIT_VALUE;
+	cobs_encoder_put_crc(&enc, hdr, hdr_len, &crc);
+	for (i = 0; i < iovcnt; i++)
+		cobs_encoder_put_crc(&enc, iov[i].base, iov[i].len, &crc);
+	crc_buf[0] = crc & 0xff;
+	crc_buf[1] = (crc >> 8) & 0xff;
+	cobs_encoder_put(&enc, crc_buf, sizeof(crc_buf));
+
+	return cobs_encoder_finish(&enc);
 }
 
 
-// This function must not be called from several places at once.
-// We call it only from comm task.
-static void transmitter_send(struct transmitter *t)
+static inline size_t
+tx_frame_max_size(size_t hdr_len, const struct comm_iovec *iov, size_t iovcnt)
 {
-	ets_intr_lock();
-	t->task_pending = false;
-	ets_intr_unlock();
+	size_t len = hdr_len + 2;
+	size_t i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+	return COBS_ENCODED_MAX_SIZE(len) + 1;
+}
+
+
+// This function can be called from different contexts. Only queue
+// bookkeeping is done with interrupts disabled. Descriptor index of the
+// frame is stored to desc_out, if it's not NULL.
+static bool ICACHE_FLASH_ATTR
+transmitter_pushv(struct transmitter *t, const uint8_t *hdr, size_t hdr_len,
+                  const struct comm_iovec *iov, size_t iovcnt, size_t prio,
+                  uint32_t *desc_out)
+{
+	uint32_t cycles = get_ccount();
+	struct tx_queue *q = &t->q[prio];
+	uint32_t desc_i, end;
+
+	if (!transmitter_reserve(t, q, tx_frame_max_size(hdr_len, iov, iovcnt),
+	                         &desc_i))
+		return false;
+
+	end = tx_encode(q->arena, q->mask, q->desc[desc_i & TX_DESC_MASK].start,
+	                hdr, hdr_len, iov, iovcnt);
+	transmitter_commit(t, q, desc_i, end);
+	transmitter_kick(t);
+	if (desc_out)
+		*desc_out = desc_i;
+
+	// Statistics may be slightly off if interrupted by another push
+	cycles = get_ccount() - cycles;
+	t->push_n++;
+	t->push_cycles += cycles;
+	if (cycles > t->push_cycles_max)
+		t->push_cycles_max = cycles;
+	return true;
+}
+
+
+static inline bool
+tx_queue_empty(struct tx_queue *q)
+{
+	return q->desc_read_i == q->desc_write_i;
+}
+
+
+static inline bool
+transmitter_busy(struct transmitter *t)
+{
+	size_t i;
+
+	for (i = 0; i < TX_QUEUES; i++)
+		if (!tx_queue_empty(&t->q[i]))
+			return true;
+	return false;
+}
+
+
+// Picks queue for the next frame. Priorities are strict, but a queue with
+// non-zero weight gets one frame through after it was passed over `weight`
+// times, so bulk data can be given a guaranteed share of the link.
+static int
+transmitter_pick(struct transmitter *t)
+{
+	int pick = -1;
+	int i;
+
+	for (i = TX_QUEUES - 1; i >= 0; i--) {
+		struct tx_queue *q = &t->q[i];
+		if (tx_queue_empty(q))
+			continue;
+		if ((pick < 0) || (q->weight && (q->passed_over >= q->weight)))
+			pick = i;
+	}
+
+	for (i = 0; i < TX_QUEUES; i++) {
+		struct tx_queue *q = &t->q[i];
+		if (i == pick)
+			q->passed_over = 0;
+		else if (!tx_queue_empty(q))
+			q->passed_over++;
+	}
+
+	return pick;
+}
+
+
+static inline uint32_t
+isqrt(uint32_t x)
+{
+	uint32_t r = 0;
+	uint32_t bit = 1 << 30;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+
+// Next drop time, t + interval / sqrt(count). Square root is taken in Q8,
+// it's computed only when a frame is dropped.
+static inline uint32_t
+codel_control_law(struct codel *c, uint32_t t)
+{
+	uint32_t count = MIN(c->count, 0xffff);
+
+	return t + (c->interval << 8) / isqrt(count << 16);
+}
+
+
+// Delay must stay above target for a whole interval before the first drop,
+// a frame alone in queue is never dropped.
+static inline bool
+codel_ok_to_drop(struct codel *c, struct tx_queue *q, uint32_t sojourn,
+                 uint32_t now)
+{
+	if ((sojourn < c->target) || (q->desc_write_i - q->desc_read_i <= 1)) {
+		c->first_above = 0;
+		return false;
+	}
+
+	if (!c->first_above) {
+		c->first_above = (now + c->interval) | 1; // 0 means unset
+		return false;
+	}
+
+	return (int32_t)(now - c->first_above) >= 0;
+}
+
+
+// Decides if frame d, which is about to be sent, should be dropped. In
+// dropping state drops are spaced by interval / sqrt(count), state is left
+// as soon as delay falls below target.
+static bool
+codel_drop(struct codel *c, struct tx_queue *q, struct tx_desc *d)
+{
+	uint32_t now = system_get_time();
+	bool ok_to_drop;
 
+	if (!c->interval)
+		return false;
+
+	ok_to_drop = codel_ok_to_drop(c, q, now - d->time, now);
+
+	if (c->dropping) {
+		if (!ok_to_drop) {
+			c->dropping = false;
+			return false;
+		}
+		if ((int32_t)(now - c->drop_next) < 0)
+			return false;
+		c->count++;
+		c->drop_next = codel_control_law(c, c->drop_next);
+		return true;
+	}
+
+	if (!ok_to_drop)
+		return false;
+
+	// Resume with recent drop rate if dropping state was left shortly ago
+	c->dropping = true;
+	if ((c->count - c->last_count > 1) &&
+	    (now - c->drop_next < 16 * c->interval))
+		c->count = c->count - c->last_count;
+	else
+		c->count = 1;
+	c->last_count = c->count;
+	c->drop_next = codel_control_law(c, now);
+	return true;
+}
+
+
+static void
+tx_queue_account(struct tx_queue *q, struct tx_desc *d)
+{
+	uint32_t wait = system_get_time() - d->time;
+	size_t bucket = wait ? 32 - __builtin_clz(wait) : 0;
+
+	q->latency[MIN(bucket, TX_LATENCY_BUCKETS - 1)]++;
+}
+
+
+/* ------------------------------------------------------------------ framing */
+
+// Optional header fields following type byte, enabled by host with
+// MSG_SET_FRAMING. Copies of recent control messages are kept in
+// retransmit buffer, so host can request them again with MSG_NACK.
+#define FRAMING_HDR_MAX_SIZE 3
+
+#define RETX_SLOTS 8
+#define RETX_MAX_DATA PRINT_BUF_SIZE
+
+struct retx_slot {
+	bool valid;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t req_id;
+	uint16_t len;
+	uint8_t data[RETX_MAX_DATA];
+};
+
+struct framing {
+	uint8_t flags;
+	uint8_t tx_seq;
+	uint8_t rx_seq; // next expected
+	uint8_t req_id; // id of request being dispatched, 0 otherwise
+
+	uint32_t rx_gaps;     // number of frames from host that were lost
+	uint32_t rx_reorders; // frames that came late or twice
+	uint32_t retransmits;
+	uint32_t retransmit_misses;
+
+	struct retx_slot retx[RETX_SLOTS];
+	uint8_t retx_next;
+};
+
+struct framing framing_uart0;
+
+
+// With FRAMING_BATCH small packets are coalesced into a single MSG_BATCH
+// frame while transmitter is busy. Each item is prefixed with
+// | uint16_t len | uint8_t type |.
+#define BATCH_BUF_SIZE 512
+#define BATCH_ITEM_HDR_SIZE 3
+#define BATCH_ITEM_MAX_SIZE 128
+
+struct batcher {
+	uint8_t buf[BATCH_BUF_SIZE];
+	size_t len;
+	size_t n;
+	size_t prio;
+};
+
+struct batcher batcher_uart0;
+
+
+static void ICACHE_FLASH_ATTR
+framing_init(struct framing *f, uint8_t flags)
+{
+	size_t i;
+
+	f->flags = flags;
+	f->tx_seq = 0;
+	f->rx_seq = 0;
+	f->req_id = 0;
+	f->retx_next = 0;
+	for (i = 0; i < RETX_SLOTS; i++)
+		f->retx[i].valid = false;
+}
+
+
+static bool ICACHE_FLASH_ATTR
+batcher_fits(struct batcher *b, size_t len)
+{
+	return b->len + BATCH_ITEM_HDR_SIZE + len <= sizeof(b->buf);
+}
+
+
+static void ICACHE_FLASH_ATTR
+batcher_add(struct batcher *b, uint8_t type,
+            const struct comm_iovec *iov, size_t iovcnt, size_t len,
+            size_t prio)
+{
+	uint8_t *p = b->buf + b->len;
+	size_t i;
+
+	*p++ = len & 0xff;
+	*p++ = (len >> 8) & 0xff;
+	*p++ = type;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].base, iov[i].len);
+		p += iov[i].len;
+	}
+
+	b->len = p - b->buf;
+	b->n++;
+	if (b->n == 1 || prio > b->prio)
+		b->prio = prio;
+}
+
+
+static inline size_t ICACHE_FLASH_ATTR
+framing_hdr_len(struct framing *f)
+{
+	return 1 + !!(f->flags & FRAMING_SEQ) + !!(f->flags & FRAMING_REQ_ID);
+}
+
+
+static size_t ICACHE_FLASH_ATTR
+framing_build_hdr(struct framing *f, uint8_t *hdr, uint8_t type, uint8_t seq,
+                  uint8_t req_id)
+{
+	size_t n = 0;
+
+	hdr[n++] = type;
+	if (f->flags & FRAMING_SEQ)
+		hdr[n++] = seq;
+	if (f->flags & FRAMING_REQ_ID)
+		hdr[n++] = req_id;
+	return n;
+}
+
+
+// Checks header of a message from host. Sequence numbers are 8 bit, so
+// anything more than half the range ahead is considered to be late.
+static void ICACHE_FLASH_ATTR
+framing_rx_hdr(struct framing *f, const uint8_t *hdr)
+{
+	size_t n = 1;
+
+	if (f->flags & FRAMING_SEQ) {
+		uint8_t seq = hdr[n++];
+		uint8_t diff = seq - f->rx_seq;
+		if (diff < 0x80) {
+			f->rx_gaps += diff;
+			f->rx_seq = seq + 1;
+		} else {
+			f->rx_reorders++;
+		}
+	}
+
+	if (f->flags & FRAMING_REQ_ID)
+		f->req_id = hdr[n++];
+}
+
+
+static void ICACHE_FLASH_ATTR
+framing_retx_store(struct framing *f, uint8_t type, uint8_t seq,
+                   uint8_t req_id, const struct comm_iovec *iov, size_t iovcnt)
+{
+	struct retx_slot *slot = &f->retx[f->retx_next];
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+	if (len > sizeof(slot->data))
+		return;
+
+	slot->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(slot->data + slot->len, iov[i].base, iov[i].len);
+		slot->len += iov[i].len;
+	}
+	slot->type = type;
+	slot->seq = seq;
+	slot->req_id = req_id;
+	slot->valid = true;
+
+	f->retx_next = (f->retx_next + 1) % RETX_SLOTS;
+}
+
+
+// Refills uart fifo from queues. Called only from interrupt handler, so it
+// lives in IRAM and doesn't need any locking.
+// Queue is switched only on frame boundaries, frames are never interleaved.
+static void transmitter_fill(struct transmitter *t)
+{
 	uint32 fifo_cnt = (READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) &
 		UART_TXFIFO_CNT;
 	size_t fifo_free_n = 126 - fifo_cnt;
-	if (fifo_free_n == 0) {
-		uart0_tx_intr_enable();
-		return;
-	}
+	uint32_t freed = 0;
+	uint32_t sent = 0;
+
+	// Fifo ran dry while more data was queued, line was idle for a while
+	if (t->streaming && !fifo_cnt)
+		t->fifo_idle++;
+
+	while (fifo_free_n) {
+		struct tx_queue *q;
+		struct tx_desc *d;
+
+		if (t->cur < 0) {
+			t->cur = transmitter_pick(t);
+			if (t->cur < 0)
+				break;
+			q = &t->q[t->cur];
+			d = &q->desc[q->desc_read_i & TX_DESC_MASK];
+			// skip unused tail of previous reservation
+			freed += d->start - q->read_i;
+			q->read_i = d->start;
+
+			bool drop = d->dead;
+			if (!drop && codel_drop(&q->codel, q, d)) {
+				q->aqm_dropped++;
+				drop = true;
+			}
+			if (drop) {
+				freed += d->end - d->start;
+				q->read_i = d->end;
+				q->desc_read_i++;
+				t->cur = -1;
+				continue;
+			}
+			tx_queue_account(q, d);
+		}
 
-	// TODO: I'm not sure if it's edge triggered or value triggered,
-	// enable it for now to be safe.
-	while (fifo_free_n && (t->buf_read_i != t->buf_write_i)) {
-		size_t buf_idx = t->buf_read_i & TX_RING_BUFFER_MASK;
-		uint8_t *buf = t->bufs[buf_idx];
-		size_t len = t->buf_lens[buf_idx];
-		size_t idx = t->idx_in_buf;
+		q = &t->q[t->cur];
+		d = &q->desc[q->desc_read_i & TX_DESC_MASK];
 
-		for (; (idx < len) && fifo_free_n; idx++) {
-			WRITE_PERI_REG(UART_FIFO(0), buf[idx]);
-			fifo_free_n--;
+		uint32_t read_i = q->read_i;
+		for (; fifo_free_n && (read_i != d->end); fifo_free_n--) {
+			WRITE_PERI_REG(UART_FIFO(0), q->arena[read_i & q->mask]);
+			read_i++;
 		}
+		sent += read_i - q->read_i;
+		q->read_i = read_i;
 
-		if (idx != len) {
-			t->idx_in_buf = idx;
-			break;
-		} else {
-			t->buf_read_i++;
-			t->idx_in_buf = 0;
-			os_free(buf);
+		if (read_i == d->end) {
+			q->frames++;
+			q->desc_read_i++;
+			t->cur = -1;
 		}
 	}
 
-	if ((!fifo_free_n) && (t->buf_read_i != t->buf_write_i)) {
-		uart0_tx_intr_enable();
+	budget_give(&t->budget, freed + sent);
+	t->bytes += sent;
+
+	// Interrupt stays enabled while there's something to send and fires
+	// again when fifo drains below threshold.
+	t->streaming = (t->cur >= 0) || transmitter_busy(t);
+	if (!t->streaming) {
+		uart0_tx_intr_disable();
+		// Line is about to go idle, send whatever was coalesced meanwhile
+		if (batcher_uart0.n)
+			transmitter_wake_task(t);
 	}
 }
 
 
+/* ------------------------------------------------------------- ack thinning */
+
+// Pure TCP ACKs sent to host are tracked while queued, so a newer cumulative
+// ACK of the same flow can take place of a queued one. New ACK is encoded
+// with sequence number of the old frame and written over it if encoded size
+// is the same, otherwise new one is queued and only then the old frame is
+// marked dead, so a full queue never loses the queued ACK.
+// Duplicate ACKs (same ack number) are never merged, TCP sender needs them
+// for fast retransmit.
+#define ACK_SLOTS 8
+#define ACK_FRAME_MAX 128 // encoded ACKs are well below this
+
+struct ack_slot {
+	struct comm_ack_key key;
+	uint32_t ack;
+	uint32_t desc_i;
+	uint8_t prio;
+	uint8_t seq;
+	bool valid;
+};
+
+static struct ack_slot ack_slots[ACK_SLOTS];
+static size_t ack_slot_next;
+
+
+// True if frame wasn't taken for sending yet. Called with interrupts
+// disabled.
+static inline bool
+tx_desc_pending(struct transmitter *t, size_t prio, uint32_t desc_i)
+{
+	struct tx_queue *q = &t->q[prio];
+
+	if (desc_i - q->desc_read_i >= q->desc_reserve_i - q->desc_read_i)
+		return false;
+	return !((t->cur == (int)prio) && (desc_i == q->desc_read_i));
+}
+
+
+// Writes new ACK over the queued one if it's still pending and encodes to
+// the same size. Slot is invalidated if the frame was taken for sending.
+static bool ICACHE_FLASH_ATTR
+ack_overwrite(struct transmitter *t, struct ack_slot *slot, uint8_t type,
+              const struct comm_iovec *iov, size_t iovcnt)
+{
+	struct tx_queue *q = &t->q[slot->prio];
+	uint8_t hdr[FRAMING_HDR_MAX_SIZE];
+	uint8_t buf[ACK_FRAME_MAX];
+	size_t hdr_len;
+	struct tx_desc *d;
+	uint32_t n, i;
+
+	hdr_len = framing_build_hdr(&framing_uart0, hdr, type, slot->seq, 0);
+	if (tx_frame_max_size(hdr_len, iov, iovcnt) > sizeof(buf))
+		return false;
+	n = tx_encode(buf, sizeof(buf) - 1, 0, hdr, hdr_len, iov, iovcnt);
+
+	comm_intr_lock();
+	if (!tx_desc_pending(t, slot->prio, slot->desc_i)) {
+		comm_intr_unlock();
+		slot->valid = false;
+		return false;
+	}
+
+	d = &q->desc[slot->desc_i & TX_DESC_MASK];
+	if (d->end - d->start != n) {
+		comm_intr_unlock();
+		return false;
+	}
+	for (i = 0; i < n; i++)
+		q->arena[(d->start + i) & q->mask] = buf[i];
+	t->acks_replaced++;
+	t->ack_bytes_saved += n;
+	comm_intr_unlock();
+	return true;
+}
+
+
+// Old ACK of the slot is skipped by sender, called once the newer one is
+// queued
+static void ICACHE_FLASH_ATTR
+ack_kill(struct transmitter *t, struct ack_slot *slot)
+{
+	struct tx_queue *q = &t->q[slot->prio];
+	struct tx_desc *d = &q->desc[slot->desc_i & TX_DESC_MASK];
+
+	comm_intr_lock();
+	if (tx_desc_pending(t, slot->prio, slot->desc_i)) {
+		d->dead = true;
+		t->acks_dropped++;
+		t->ack_bytes_saved += d->end - d->start;
+	}
+	comm_intr_unlock();
+}
+
+
+static void ICACHE_FLASH_ATTR
+ack_slots_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < ACK_SLOTS; i++)
+		ack_slots[i].valid = false;
+}
+
+
 /* ------------------------------------------------------------------ receive */
 
 struct decoder {
 	struct cobs_decoder cobs;
-	uint8_t buf[BUF_ALIGN_OFFSET + COBS_ENCODED_MAX_SIZE(MAX_MESSAGE_SIZE)];
+	uint8_t buf[BUF_ALIGN + COBS_ENCODED_MAX_SIZE(MAX_MESSAGE_SIZE)]
+		__attribute__((aligned(BUF_ALIGN)));
 
 	uint32_t proto_errors;
 	uint32_t crc_errors;
 	comm_callback_t cb;
+
+	const struct comm_rx_alloc *alloc;
+	void *rx_handle; // buffer from allocator, kept until delivered
+	uint8_t *rx_buf;
+	size_t rx_size;
+	uint8_t rx_type;
+
+	// With flow control, message the application isn't ready for is held
+	// and decoding stops, the rest stays in rx ring and holds back credit
+	// (or RTS). do_rx() dispatches it once application calls
+	// comm_rx_resume().
+	bool may_hold;
+	bool held;
+	bool held_redirected;
+	uint8_t held_type;
+	uint8_t held_req_id;
+	uint8_t *held_data; // payload, or next item of a batch
+	size_t held_len;
 };
 
 struct decoder dec_uart0;
 
 
+// len is buffer size application would have to allocate for the message,
+// 0 if it was decoded into buffer from alloc().
+static bool ICACHE_FLASH_ATTR
+decoder_ready(struct decoder *dec, uint8_t type, size_t len)
+{
+	const struct comm_rx_alloc *a = dec->alloc;
+
+	return !dec->may_hold || !a || !a->ready || a->ready(type, len);
+}
+
+static void ICACHE_FLASH_ATTR
+decoder_hold(struct decoder *dec, uint8_t type, uint8_t *data, size_t len,
+             bool redirected)
+{
+	dec->held = true;
+	dec->held_redirected = redirected;
+	dec->held_type = type;
+	dec->held_req_id = framing_uart0.req_id;
+	dec->held_data = data;
+	dec->held_len = len;
+}
+
+// Items of a batch are not aligned. Each one is moved to aligned position
+// before dispatching, overwriting data which has already been processed.
+// Returns false if the rest of batch is held.
+static bool ICACHE_FLASH_ATTR
+decoder_dispatch_batch(struct decoder *dec, uint8_t *data, size_t len)
+{
+	uint8_t *p = data;
+	uint8_t *end = data + len;
+
+	while (p < end) {
+		if (end - p < BATCH_ITEM_HDR_SIZE) {
+			dec->proto_errors++;
+			return true;
+		}
+
+		size_t item_len = p[0] | (p[1] << 8);
+		uint8_t type = p[2];
+		uint8_t *item = p + BATCH_ITEM_HDR_SIZE;
+		if (item_len > end - item) {
+			dec->proto_errors++;
+			return true;
+		}
+
+		if (!decoder_ready(dec, type, item_len)) {
+			decoder_hold(dec, MSG_BATCH, p, end - p, false);
+			return false;
+		}
+
+		uint8_t *aligned = (uint8_t *)((uintptr_t)item & ~(BUF_ALIGN - 1));
+		memmove(aligned, item, item_len);
+
+		if (dec->cb && (type != MSG_BATCH))
+			dec->cb(type, aligned, item_len);
+		p = item + item_len;
+	}
+	return true;
+}
+
+// Returns false if message is held
+static bool ICACHE_FLASH_ATTR
+decoder_dispatch(struct decoder *dec, uint8_t type, uint8_t *payload,
+                 size_t len, bool redirected)
+{
+	if (type == MSG_BATCH)
+		return decoder_dispatch_batch(dec, payload, len);
+
+	if (!decoder_ready(dec, type, redirected ? 0 : len)) {
+		decoder_hold(dec, type, payload, len, redirected);
+		return false;
+	}
+
+	if (redirected) {
+		void *handle = dec->rx_handle;
+		dec->rx_handle = NULL;
+		dec->alloc->deliver(type, handle, payload, len);
+	} else if (dec->cb) {
+		dec->cb(type, payload, len);
+	}
+	return true;
+}
+
+// Dispatches held message, returns false if it's still held
+static bool ICACHE_FLASH_ATTR
+decoder_resume(struct decoder *dec)
+{
+	bool done;
+
+	if (!dec->held)
+		return true;
+
+	dec->held = false;
+	framing_uart0.req_id = dec->held_req_id;
+	done = decoder_dispatch(dec, dec->held_type, dec->held_data,
+	                        dec->held_len, dec->held_redirected);
+	framing_uart0.req_id = 0;
+	return done;
+}
+
+// Packet payload is decoded straight into a buffer from rx allocator (i.e.
+// pbuf), so it's not copied once more before injection. Buffer of a frame
+// that was lost to crc error or truncation is reused for the next one.
+static void ICACHE_FLASH_ATTR
+decoder_split_cb(void *decoder, uint8_t *hdr, size_t n)
+{
+	struct decoder *dec = decoder;
+	const struct comm_rx_alloc *a = dec->alloc;
+
+	if (!a)
+		return;
+
+	if (!dec->rx_handle || (dec->rx_type != hdr[0])) {
+		uint8_t *buf;
+		size_t size;
+		void *handle = a->alloc(hdr[0], &buf, &size);
+
+		// Not a packet or out of memory, use our buffer
+		if (!handle)
+			return;
+
+		if (dec->rx_handle)
+			a->release(dec->rx_handle);
+		dec->rx_handle = handle;
+		dec->rx_buf = buf;
+		dec->rx_size = size;
+		dec->rx_type = hdr[0];
+	}
+
+	cobs_decoder_redirect(&dec->cobs, dec->rx_buf, dec->rx_size);
+}
+
 static inline void ICACHE_FLASH_ATTR
 decoder_check_and_dispatch_cb(void *decoder, uint8_t *data, size_t len)
 {
 	struct decoder *dec = decoder;
-	uint16_t crc_msg;
-	uint16_t crc_calc;
+	size_t hdr_len = framing_hdr_len(&framing_uart0);
+	bool redirected = dec->cobs.redirected;
+	uint8_t *hdr = data;
+	uint8_t *payload = data + hdr_len;
+
+	// Header of redirected frame is left in our buffer, data holds only
+	// payload and crc
+	if (redirected) {
+		hdr = dec->cobs.base;
+		payload = data;
+		len += hdr_len;
+	}
 
-	if (len < 3) {
+	if (len < hdr_len + 2) {
 		dec->proto_errors ++;
 		return;
 	}
+	len -= hdr_len + 2;
 
-	crc_calc = crc16_block(data, len - 2);
-	memcpy(&crc_msg, data + len - 2, 2);
-	if (crc_calc != crc_msg) {
+	// crc is calculated by decoder over the whole frame including
+	// trailing crc field, so for a valid frame it must be zero
+	if (dec->cobs.crc != 0) {
 		dec->crc_errors++;
 		return;
 	}
 
-	if (dec->cb)
-		dec->cb(data[0], data + 1, len - 3);
+	// Everything sent by callback is marked with request id
+	framing_rx_hdr(&framing_uart0, hdr);
+
+	if (!decoder_dispatch(dec, hdr[0], payload, len, redirected))
+		cobs_decoder_stop(&dec->cobs);
+
+	framing_uart0.req_id = 0;
 }
 
 static inline void ICACHE_FLASH_ATTR
-decoder_init(struct decoder *dec, comm_callback_t cb)
+decoder_set_hdr_len(struct decoder *dec, size_t hdr_len)
 {
+	// Safe to call from callback, decoder doesn't touch buffer
+	// after dispatching a frame.
+	size_t offset = BUF_ALIGN - hdr_len;
+
 	cobs_decoder_init(
 		&dec->cobs,
-		dec->buf + BUF_ALIGN_OFFSET, sizeof(dec->buf) - BUF_ALIGN_OFFSET,
+		dec->buf + offset, sizeof(dec->buf) - offset,
 		decoder_check_and_dispatch_cb, dec);
+	cobs_decoder_set_split(&dec->cobs, hdr_len, decoder_split_cb);
+}
+
+static inline void ICACHE_FLASH_ATTR
+decoder_init(struct decoder *dec, comm_callback_t cb)
+{
+	decoder_set_hdr_len(dec, 1);
 	dec->proto_errors = 0;
 	dec->crc_errors = 0;
 	dec->cb = cb;
+	dec->alloc = NULL;
+	dec->rx_handle = NULL;
+	dec->may_hold = false;
+	dec->held = false;
 }
 
-static inline void ICACHE_FLASH_ATTR
+// Returns number of bytes consumed, less than len if a message was held
+static inline size_t ICACHE_FLASH_ATTR
 decoder_put_data(struct decoder *dec, void *data, size_t len)
 {
-	cobs_decoder_put(&dec->cobs, data, len);
+	return cobs_decoder_put(&dec->cobs, data, len);
 }
 
-static void do_rx()
+
+// Raw bytes are moved from uart fifo into this ring right in the interrupt
+// handler, and comm task feeds them to decoder in bulk. It holds a couple
+// of max sized frames, so task latency doesn't overrun 128 byte hw fifo.
+// Single producer (irq) / single consumer (task), no locking required.
+#define RX_RING_SIZE 4096
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+// With RTS/CTS flow control RTS is deasserted when ring fill level reaches
+// RX_RTS_OFF_LEVEL and asserted again once it drops to RX_RTS_ON_LEVEL.
+// Some slack is left for bytes that host sends before noticing RTS.
+#define RX_RTS_OFF_LEVEL (RX_RING_SIZE * 3 / 4)
+#define RX_RTS_ON_LEVEL  (RX_RING_SIZE / 4)
+
+// With FRAMING_RX_CREDIT host counts bytes it has sent since the delimiter
+// of the frame that enabled credits, and never lets it exceed limit
+// advertised with MSG_RX_CREDIT. Limit is number of bytes consumed from the
+// ring plus its size, so the ring never overflows. New limit is sent when
+// it has grown by RX_CREDIT_STEP, and periodically in case a message was
+// lost.
+#define RX_CREDIT_WINDOW RX_RING_SIZE
+#define RX_CREDIT_STEP (RX_CREDIT_WINDOW / 4)
+#define RX_CREDIT_PERIOD_MS 250
+#define RX_CREDIT_REPEAT 4 // periods
+
+struct receiver {
+	uint8_t ring[RX_RING_SIZE];
+	volatile uint32_t read_i;
+	volatile uint32_t write_i;
+	struct budget budget; // bytes not consumed by decoder yet
+
+	volatile bool task_pending;
+	volatile bool stalled; // ring was full, rx interrupt is disabled
+	uint32_t overruns;     // hw fifo overflows, i.e. data was lost
+
+	bool flow_ctrl;        // RTS is driven by ring fill level
+	volatile bool rts_off;
+	uint32_t rts_stalls;   // number of times RTS was deasserted
+
+	bool credit;            // host obeys advertised credit
+	uint32_t credit_origin; // ring index where host started counting
+	uint32_t credit_sent;   // last advertised limit
+	uint32_t credit_idle;   // timer periods since credit was sent
+	os_timer_t credit_timer;
+};
+
+struct receiver receiver_uart0;
+
+
+static void ICACHE_FLASH_ATTR
+receiver_init(struct receiver *r)
 {
-	uint8_t buf[64];
-	uint32_t i, n;
-	uint8 c;
-	int total = 0;
+	r->read_i = 0;
+	r->write_i = 0;
+	budget_init(&r->budget, RX_RING_SIZE);
+	r->task_pending = false;
+	r->stalled = false;
+	r->overruns = 0;
+	r->flow_ctrl = false;
+	r->rts_off = false;
+	r->rts_stalls = 0;
+	r->credit = false;
+}
 
-	while (1) {
-		n = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) &
-			UART_RXFIFO_CNT;
-		if (!n)
-			break;
 
-		n = MIN(n, sizeof(buf));
-		for (i = 0; i < n; i++) {
-		    buf[i] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-		    total++;
+// Called from interrupt handler. Returns false if ring is full and some
+// data was left in hw fifo.
+static bool receiver_fill(struct receiver *r)
+{
+	uint32_t write_i = r->write_i;
+	uint32_t ring_free = r->budget.limit - r->budget.used;
+	uint32_t n = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) &
+		UART_RXFIFO_CNT;
+	bool all = true;
+
+	if (n > ring_free) {
+		n = ring_free;
+		all = false;
+	}
+
+	budget_take(&r->budget, n);
+	while (n--)
+		r->ring[write_i++ & RX_RING_MASK] =
+			READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+	r->write_i = write_i;
+
+	if (r->flow_ctrl && !r->rts_off &&
+	    (r->budget.used >= RX_RTS_OFF_LEVEL)) {
+		uart0_set_rts(false);
+		r->rts_off = true;
+		r->rts_stalls++;
+	}
+
+	if (!r->task_pending) {
+		r->task_pending = true;
+		system_os_post(COMM_TASK_PRIO, DO_RX, 0);
+	}
+
+	return all;
+}
+
+
+static inline uint32_t ICACHE_FLASH_ATTR
+receiver_credit_limit(struct receiver *r)
+{
+	return r->read_i - r->credit_origin + RX_CREDIT_WINDOW;
+}
+
+
+static void ICACHE_FLASH_ATTR
+receiver_send_credit(struct receiver *r, uint32_t limit)
+{
+	r->credit_sent = limit;
+	r->credit_idle = 0;
+	comm_send_ctl_id(0, MSG_RX_CREDIT, &limit, sizeof(limit));
+}
+
+
+// Sends credit that has grown by less than RX_CREDIT_STEP since the last
+// one. Unchanged credit is repeated only every RX_CREDIT_REPEAT periods,
+// in case the last one was lost while host waits for it.
+static void ICACHE_FLASH_ATTR
+receiver_credit_timer(void *arg)
+{
+	struct receiver *r = arg;
+	uint32_t limit = receiver_credit_limit(r);
+
+	if (!r->credit)
+		return;
+
+	if ((limit != r->credit_sent) ||
+	    (++r->credit_idle >= RX_CREDIT_REPEAT))
+		receiver_send_credit(r, limit);
+}
+
+
+// Must be called from callback of the frame which enables credits, its
+// delimiter is the origin of byte count.
+static void ICACHE_FLASH_ATTR
+receiver_set_credit(struct receiver *r, bool enable)
+{
+	os_timer_disarm(&r->credit_timer);
+	r->credit = enable;
+	if (!enable)
+		return;
+
+	// read_i points to the beginning of data being decoded
+	r->credit_origin = r->read_i + dec_uart0.cobs.eof_off;
+	receiver_send_credit(r, RX_CREDIT_WINDOW);
+
+	os_timer_setfn(&r->credit_timer, receiver_credit_timer, r);
+	os_timer_arm(&r->credit_timer, RX_CREDIT_PERIOD_MS, true);
+}
+
+
+static void ICACHE_FLASH_ATTR
+do_rx()
+{
+	struct receiver *r = &receiver_uart0;
+
+	comm_intr_lock();
+	r->task_pending = false;
+	comm_intr_unlock();
+
+	uint32_t read_i = r->read_i;
+	uint32_t write_i;
+
+	// Without flow control bytes left in ring would be lost to hw fifo
+	// overruns instead, so packets are rather dropped by application.
+	dec_uart0.may_hold = r->credit || r->flow_ctrl;
+	decoder_resume(&dec_uart0);
+
+	while (!dec_uart0.held && (read_i != (write_i = r->write_i))) {
+		uint32_t off = read_i & RX_RING_MASK;
+		uint32_t n = MIN(write_i - read_i, RX_RING_SIZE - off);
+
+		n = decoder_put_data(&dec_uart0, r->ring + off, n);
+		read_i += n;
+		r->read_i = read_i;
+
+		comm_intr_lock();
+		budget_give(&r->budget, n);
+		comm_intr_unlock();
+	}
+
+	if (r->rts_off) {
+		comm_intr_lock();
+		if (r->rts_off && (r->budget.used <= RX_RTS_ON_LEVEL)) {
+			r->rts_off = false;
+			uart0_set_rts(true);
 		}
-		decoder_put_data(&dec_uart0, buf, n);
+		comm_intr_unlock();
 	}
 
-	uart0_rx_intr_enable();
+	if (r->credit) {
+		uint32_t limit = receiver_credit_limit(r);
+		if (limit - r->credit_sent >= RX_CREDIT_STEP)
+			receiver_send_credit(r, limit);
+	}
+
+	// Interrupt is disabled while stalled, so there's no race here. Ring
+	// is not drained while a message is held, comm_rx_resume() gets here
+	// again.
+	if (r->stalled && !dec_uart0.held) {
+		r->stalled = false;
+		uart0_rx_intr_enable();
+	}
 }
 
 
@@ -271,7 +1372,7 @@ static void comm_task(os_event_t *e)
 {
 	switch (e->sig) {
 	case DO_RX: do_rx(); break;
-	case DO_TX: transmitter_send(&transmitter_uart0); break;
+	case DO_TX: transmitter_idle(&transmitter_uart0); break;
 	default: COMM_ERR("unknown task variant");
 	}
 }
@@ -280,22 +1381,32 @@ static void comm_task(os_event_t *e)
 // FIXME name. Actually it handles all uart events, not only rx.
 void uart0_rx_intr_handler(void *para)
 {
+	uint32_t cycles = get_ccount();
 	uint32_t stat = READ_PERI_REG(UART_INT_ST(UART0));
 
 	if (stat & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) {
-		uart0_rx_intr_disable();
+		if (!receiver_fill(&receiver_uart0)) {
+			// Leave the rest in hw fifo until task makes some room
+			receiver_uart0.stalled = true;
+			uart0_rx_intr_disable();
+		}
 		WRITE_PERI_REG(UART_INT_CLR(UART0),
 		               UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
+	}
 
-		system_os_post(COMM_TASK_PRIO, DO_RX, 0);
+	if (stat & UART_RXFIFO_OVF_INT_ST) {
+		receiver_uart0.overruns++;
+		WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_OVF_INT_CLR);
 	}
 
 	if (stat & UART_TXFIFO_EMPTY_INT_ST) {
-		uart0_tx_intr_disable();
+		transmitter_fill(&transmitter_uart0);
 		WRITE_PERI_REG(UART_INT_CLR(UART0), UART_TXFIFO_EMPTY_INT_CLR);
-
-		transmitter_wake_task(&transmitter_uart0);
 	}
+
+	cycles = get_ccount() - cycles;
+	if (cycles > isr_max)
+		isr_max = cycles;
 }
 
 
@@ -316,38 +1427,404 @@ os_event_t comm_queue[3];
 void ICACHE_FLASH_ATTR
 comm_init(comm_callback_t cb) {
 	decoder_init(&dec_uart0, cb);
+	framing_init(&framing_uart0, 0);
+	batcher_uart0.len = 0;
+	batcher_uart0.n = 0;
+	receiver_init(&receiver_uart0);
 	transmitter_init(&transmitter_uart0);
 
 	system_os_task(comm_task, COMM_TASK_PRIO, comm_queue, ARRAY_SIZE(comm_queue));
 	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+	uart0_set_tx_empty_threshold(TX_FIFO_THRESHOLD);
 	uart_tx_one_char(UART0, COBS_BYTE_EOF);
+	SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_RXFIFO_OVF_INT_ENA);
 	uart0_rx_intr_enable();
 }
 
 
 void ICACHE_FLASH_ATTR
-comm_get_stats(uint32_t *rx_errors,
-               uint32_t *rx_crc_errors,
-               uint32_t *dropped_packets) {
-	*rx_errors = dec_uart0.proto_errors + dec_uart0.crc_errors;
-	*rx_crc_errors = dec_uart0.crc_errors;
-	*dropped_packets = transmitter_uart0.dropped_packets;
+comm_get_stats(struct comm_stats *stats) {
+	size_t i;
+
+	stats->rx_errors = dec_uart0.proto_errors + dec_uart0.crc_errors;
+	stats->rx_crc_errors = dec_uart0.crc_errors;
+	stats->rx_overruns = receiver_uart0.overruns;
+	stats->dropped_packets = transmitter_uart0.dropped_packets;
+	stats->rx_rts_stalls = receiver_uart0.rts_stalls;
+	stats->tx_cts_stalls = transmitter_uart0.cts_stalls;
+	stats->tx_bytes = transmitter_uart0.bytes;
+	stats->tx_fifo_idle = transmitter_uart0.fifo_idle;
+	stats->rx_seq_gaps = framing_uart0.rx_gaps;
+	stats->rx_seq_reorders = framing_uart0.rx_reorders;
+	stats->retransmits = framing_uart0.retransmits;
+	stats->retransmit_misses = framing_uart0.retransmit_misses;
+	stats->tx_budget = transmitter_uart0.budget;
+	stats->rx_budget = receiver_uart0.budget;
+	stats->tx_push_n = transmitter_uart0.push_n;
+	stats->tx_push_cycles = transmitter_uart0.push_cycles;
+	stats->tx_push_cycles_max = transmitter_uart0.push_cycles_max;
+	stats->tx_acks_replaced = transmitter_uart0.acks_replaced;
+	stats->tx_acks_dropped = transmitter_uart0.acks_dropped;
+	stats->tx_ack_bytes_saved = transmitter_uart0.ack_bytes_saved;
+	stats->intr_off_cycles_max = intr_off_max;
+	stats->isr_cycles_max = isr_max;
+
+	for (i = 0; i < TX_QUEUES; i++) {
+		struct tx_queue *q = &transmitter_uart0.q[i];
+		struct comm_tx_queue_stats *qs = &stats->tx_queues[i];
+
+		qs->frames = q->frames;
+		qs->dropped = q->dropped;
+		qs->aqm_dropped = q->aqm_dropped;
+		qs->discarded = q->discarded;
+		qs->depth = q->desc_write_i - q->desc_read_i;
+		qs->latency_p50 = tx_queue_latency(q, 50);
+		qs->latency_p90 = tx_queue_latency(q, 90);
+		qs->latency_p99 = tx_queue_latency(q, 99);
+	}
+}
+
+
+// New limits apply to frames queued afterwards, frames already in queue are
+// not dropped. Statistics of the queue are reset, so effect of new settings
+// can be measured.
+bool ICACHE_FLASH_ATTR
+comm_set_tx_queue(size_t prio, uint32_t max_frames, uint32_t max_bytes,
+                  uint32_t weight)
+{
+	struct tx_queue *q;
+
+	if (prio >= TX_QUEUES)
+		return false;
+	q = &transmitter_uart0.q[prio];
+	if (!max_frames || (max_frames > TX_DESC_SLOTS) ||
+	    !max_bytes || (max_bytes > q->mask + 1))
+		return false;
+
+	comm_intr_lock();
+	q->max_frames = max_frames;
+	q->max_bytes = max_bytes;
+	q->weight = weight;
+	q->passed_over = 0;
+	tx_queue_reset_stats(q);
+	comm_intr_unlock();
+	return true;
+}
+
+
+// Interval 0 disables AQM on the queue. Control queue can't be managed,
+// its messages must not be lost.
+bool ICACHE_FLASH_ATTR
+comm_set_tx_aqm(size_t prio, uint32_t target, uint32_t interval)
+{
+	struct tx_queue *q;
+
+	if ((prio >= COMM_TX_PRIO_HIGH) || (interval >= CODEL_MAX_INTERVAL) ||
+	    (interval && (target >= interval)))
+		return false;
+	q = &transmitter_uart0.q[prio];
+
+	comm_intr_lock();
+	os_memset(&q->codel, 0, sizeof(q->codel));
+	q->codel.target = target;
+	q->codel.interval = interval;
+	tx_queue_reset_stats(q);
+	comm_intr_unlock();
+	return true;
+}
+
+
+void ICACHE_FLASH_ATTR
+comm_set_flow_control(enum flow_control_mode mode)
+{
+	struct receiver *r = &receiver_uart0;
+
+	comm_intr_lock();
+	transmitter_uart0.flow_ctrl = (mode == FLOW_CONTROL_RTS_CTS);
+	if (mode == FLOW_CONTROL_RTS_CTS) {
+		r->flow_ctrl = true;
+		r->rts_off = false;
+		uart0_set_rts(true);
+		uart0_set_flow_ctrl(HARDWARE_CTRL);
+	} else {
+		r->flow_ctrl = false;
+		r->rts_off = false;
+		uart0_set_flow_ctrl(NONE_CTRL);
+	}
+	comm_intr_unlock();
+}
+
+
+bool ICACHE_FLASH_ATTR
+comm_set_tx_threshold(uint8_t threshold)
+{
+	if (threshold >= 126)
+		return false;
+
+	uart0_set_tx_empty_threshold(threshold);
+	return true;
+}
+
+
+void ICACHE_FLASH_ATTR
+comm_set_rx_alloc(const struct comm_rx_alloc *alloc)
+{
+	struct decoder *dec = &dec_uart0;
+
+	if (dec->rx_handle) {
+		dec->alloc->release(dec->rx_handle);
+		dec->rx_handle = NULL;
+	}
+	dec->alloc = alloc;
+}
+
+
+// Called by application when it may be ready again for a message it
+// refused in ready().
+void ICACHE_FLASH_ATTR
+comm_rx_resume(void)
+{
+	struct receiver *r = &receiver_uart0;
+
+	comm_intr_lock();
+	if (!r->task_pending) {
+		r->task_pending = true;
+		system_os_post(COMM_TASK_PRIO, DO_RX, 0);
+	}
+	comm_intr_unlock();
+}
+
+
+// Marks frames of the queue that weren't taken for sending yet as dead.
+// Frame being sent is left alone, it goes out before anything queued later.
+static void ICACHE_FLASH_ATTR
+transmitter_discard(struct transmitter *t, size_t prio)
+{
+	struct tx_queue *q = &t->q[prio];
+	uint32_t i;
+
+	comm_intr_lock();
+	for (i = q->desc_read_i; i != q->desc_write_i; i++) {
+		struct tx_desc *d = &q->desc[i & TX_DESC_MASK];
+		if (!d->dead && tx_desc_pending(t, prio, i)) {
+			d->dead = true;
+			q->discarded++;
+		}
+	}
+	comm_intr_unlock();
+}
+
+
+// Sequence numbers and retransmit buffer are reset, both sides start
+// counting from zero. Must be called while handling MSG_SET_FRAMING, since
+// rx credit counting starts right after it. STATUS reply must be queued
+// before: it's sent ahead of data queues, so their frames encoded with old
+// header would follow it and host would misparse them. They are discarded.
+void ICACHE_FLASH_ATTR
+comm_set_framing(uint8_t flags)
+{
+	comm_flush_batch();
+	transmitter_discard(&transmitter_uart0, COMM_TX_PRIO_LOW);
+	transmitter_discard(&transmitter_uart0, COMM_TX_PRIO_MEDIUM);
+	framing_init(&framing_uart0, flags);
+	ack_slots_reset();
+	decoder_set_hdr_len(&dec_uart0, framing_hdr_len(&framing_uart0));
+	receiver_set_credit(&receiver_uart0, flags & FRAMING_RX_CREDIT);
+}
+
+
+bool ICACHE_FLASH_ATTR
+comm_retransmit(uint8_t seq)
+{
+	struct framing *f = &framing_uart0;
+	uint8_t hdr[FRAMING_HDR_MAX_SIZE];
+	size_t i;
+
+	for (i = 0; i < RETX_SLOTS; i++) {
+		struct retx_slot *slot = &f->retx[i];
+		if (slot->valid && (slot->seq == seq)) {
+			struct comm_iovec iov = {
+				.base = slot->data,
+				.len = slot->len
+			};
+			size_t hdr_len = framing_build_hdr(f, hdr, slot->type,
+			                                   seq, slot->req_id);
+
+			transmitter_pushv(&transmitter_uart0, hdr, hdr_len,
+			                  &iov, 1, COMM_TX_PRIO_HIGH, NULL);
+			f->retransmits++;
+			return true;
+		}
+	}
+
+	f->retransmit_misses++;
+	return false;
 }
 
 
 void ICACHE_FLASH_ATTR
 comm_send(uint8_t type, void *data, size_t n, size_t prio)
 {
-	uint8_t buf[n + 3];
+	struct comm_iovec iov = { .base = data, .len = n };
+
+	comm_sendv(type, &iov, 1, prio);
+}
+
+
+// Frame gets a sequence number even if it's dropped by transmitter, so host
+// can detect the loss. msg_n is number of messages in the frame.
+static bool ICACHE_FLASH_ATTR
+comm_push(uint8_t type, uint8_t req_id,
+          const struct comm_iovec *iov, size_t iovcnt, size_t prio,
+          size_t msg_n)
+{
+	struct framing *f = &framing_uart0;
+	struct transmitter *t = &transmitter_uart0;
+	uint8_t hdr[FRAMING_HDR_MAX_SIZE];
+	uint8_t seq = f->tx_seq++;
+	size_t hdr_len = framing_build_hdr(f, hdr, type, seq, req_id);
+
+	// Credit is superseded by the next one and re-sent anyway, it must not
+	// evict control messages from retransmit slots
+	if ((f->flags & FRAMING_SEQ) && (prio == COMM_TX_PRIO_HIGH) &&
+	    (type != MSG_RX_CREDIT))
+		framing_retx_store(f, type, seq, req_id, iov, iovcnt);
+
+	if (!transmitter_pushv(t, hdr, hdr_len, iov, iovcnt, prio, NULL)) {
+		t->dropped_packets += msg_n;
+		return false;
+	}
+	return true;
+}
+
+
+// Batch of a single message is sent as is.
+static void ICACHE_FLASH_ATTR
+comm_flush_batch(void)
+{
+	struct batcher *b = &batcher_uart0;
+	struct comm_iovec iov;
+
+	if (!b->n)
+		return;
+
+	if (b->n == 1) {
+		iov.base = b->buf + BATCH_ITEM_HDR_SIZE;
+		iov.len = b->len - BATCH_ITEM_HDR_SIZE;
+		comm_push(b->buf[2], 0, &iov, 1, b->prio, 1);
+	} else {
+		iov.base = b->buf;
+		iov.len = b->len;
+		comm_push(MSG_BATCH, 0, &iov, 1, b->prio, b->n);
+	}
+
+	b->len = 0;
+	b->n = 0;
+}
+
+
+// Only packets are batched, control messages are flushed immediately.
+// Batch is flushed before any message that is not added to it, so order
+// of messages is preserved. Returns false if message was dropped, batched
+// message counts as queued.
+static bool ICACHE_FLASH_ATTR
+comm_sendv_id(uint8_t type, uint8_t req_id,
+              const struct comm_iovec *iov, size_t iovcnt, size_t prio)
+{
+	struct batcher *b = &batcher_uart0;
+	size_t len = 0;
+	size_t i;
+
+	if ((framing_uart0.flags & FRAMING_BATCH) &&
+	    (prio != COMM_TX_PRIO_HIGH) && (req_id == 0)) {
+		for (i = 0; i < iovcnt; i++)
+			len += iov[i].len;
+
+		if (len <= BATCH_ITEM_MAX_SIZE) {
+			if (!batcher_fits(b, len))
+				comm_flush_batch();
+
+			if (transmitter_busy(&transmitter_uart0)) {
+				batcher_add(b, type, iov, iovcnt, len, prio);
+				return true;
+			}
+		}
+	}
 
-	buf[0] = type;
-	memcpy(buf + 1, data, n);
+	comm_flush_batch();
+	return comm_push(type, req_id, iov, iovcnt, prio, 1);
+}
 
-	uint16_t crc = crc16_block(buf, n + 1);
-	buf[n+1] = crc & 0xff;
-	buf[n+2] = (crc >> 8) & 0xff;
 
-	transmitter_push(&transmitter_uart0, buf, n + 3, prio);
+bool ICACHE_FLASH_ATTR
+comm_sendv(uint8_t type, const struct comm_iovec *iov, size_t iovcnt,
+           size_t prio)
+{
+	return comm_sendv_id(type, framing_uart0.req_id, iov, iovcnt, prio);
+}
+
+
+// Sends pure TCP ACK, replacing queued ACK of the same flow if this one
+// acknowledges more. ACKs bypass batcher, since only frames in queue can
+// be replaced.
+bool ICACHE_FLASH_ATTR
+comm_sendv_ack(uint8_t type, const struct comm_iovec *iov, size_t iovcnt,
+               size_t prio, const struct comm_ack_key *key, uint32_t ack)
+{
+	struct framing *f = &framing_uart0;
+	struct transmitter *t = &transmitter_uart0;
+	struct ack_slot *slot = NULL;
+	bool superseded = false;
+	uint8_t hdr[FRAMING_HDR_MAX_SIZE];
+	size_t hdr_len;
+	uint32_t desc_i;
+	uint8_t seq;
+	size_t i;
+
+	if (f->req_id)
+		return comm_sendv(type, iov, iovcnt, prio);
+
+	for (i = 0; i < ACK_SLOTS; i++) {
+		struct ack_slot *s = &ack_slots[i];
+		if (s->valid && (s->prio == prio) &&
+		    !memcmp(&s->key, key, sizeof(*key))) {
+			slot = s;
+			break;
+		}
+	}
+
+	if (slot && ((int32_t)(ack - slot->ack) > 0)) {
+		if (ack_overwrite(t, slot, type, iov, iovcnt)) {
+			slot->ack = ack;
+			return true;
+		}
+		superseded = slot->valid;
+	}
+
+	comm_flush_batch();
+	seq = f->tx_seq++;
+	hdr_len = framing_build_hdr(f, hdr, type, seq, 0);
+	if (!transmitter_pushv(t, hdr, hdr_len, iov, iovcnt, prio, &desc_i)) {
+		t->dropped_packets++;
+		return false;
+	}
+	if (superseded)
+		ack_kill(t, slot);
+
+	for (i = 0; !slot && (i < ACK_SLOTS); i++)
+		if (!ack_slots[i].valid)
+			slot = &ack_slots[i];
+	if (!slot) {
+		slot = &ack_slots[ack_slot_next];
+		ack_slot_next = (ack_slot_next + 1) % ACK_SLOTS;
+	}
+	slot->key = *key;
+	slot->ack = ack;
+	slot->desc_i = desc_i;
+	slot->prio = prio;
+	slot->seq = seq;
+	slot->valid = true;
+	return true;
 }
 
 
@@ -358,6 +1835,45 @@ comm_send_ctl(uint8_t type, void *data, size_t n)
 }
 
 
+// For replies sent after request has been handled, e.g. from SDK callbacks.
+// req_id should be obtained with comm_req_id() while handling request.
+void ICACHE_FLASH_ATTR
+comm_send_ctl_id(uint8_t req_id, uint8_t type, void *data, size_t n)
+{
+	struct comm_iovec iov = { .base = data, .len = n };
+
+	comm_sendv_id(type, req_id, &iov, 1, COMM_TX_PRIO_HIGH);
+}
+
+
+uint8_t ICACHE_FLASH_ATTR
+comm_req_id(void)
+{
+	return framing_uart0.req_id;
+}
+
+
+// Whether n frames carrying up to len bytes each would be queued at
+// priority prio right now. Lets replies longer than the queue be sent in
+// parts as it drains, instead of having their tail dropped.
+bool ICACHE_FLASH_ATTR
+comm_tx_room(size_t prio, size_t n, size_t len)
+{
+	struct transmitter *t = &transmitter_uart0;
+	struct tx_queue *q = &t->q[prio];
+	size_t bytes = n * (COBS_ENCODED_MAX_SIZE(FRAMING_HDR_MAX_SIZE +
+	                                          len + 2) + 1);
+	bool room;
+
+	comm_intr_lock();
+	room = (q->reserve_i - q->read_i + bytes <= q->max_bytes) &&
+	       (q->desc_reserve_i - q->desc_read_i + n <= q->max_frames) &&
+	       (t->budget.limit - t->budget.used >= bytes);
+	comm_intr_unlock();
+	return room;
+}
+
+
 void ICACHE_FLASH_ATTR
 comm_send_status(uint8_t s)
 {
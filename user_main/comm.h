@@ -1,6 +1,7 @@
 #ifndef COMM_H
 #define COMM_H
 #include "message.h"
+#include "budget.h"
 
 #define COMM_TX_PRIO_LOW 0
 #define COMM_TX_PRIO_MEDIUM 1
@@ -9,17 +10,103 @@
 
 typedef void (*comm_callback_t)(uint8_t type, uint8_t *data, uint32_t len);
 
+struct comm_tx_queue_stats {
+	uint32_t frames;
+	uint32_t dropped;
+	uint32_t aqm_dropped; // dropped by CoDel at dequeue
+	uint32_t discarded;   // dropped when framing changed
+	uint32_t depth;
+	// queueing latency percentiles, upper bounds in us
+	uint32_t latency_p50;
+	uint32_t latency_p90;
+	uint32_t latency_p99;
+};
+
+struct comm_stats {
+	uint32_t rx_errors;
+	uint32_t rx_crc_errors;
+	uint32_t rx_overruns;
+	uint32_t dropped_packets;
+	uint32_t rx_rts_stalls;
+	uint32_t tx_cts_stalls;
+	uint32_t tx_bytes;
+	uint32_t tx_fifo_idle;
+	uint32_t rx_seq_gaps;
+	uint32_t rx_seq_reorders;
+	uint32_t retransmits;
+	uint32_t retransmit_misses;
+	struct comm_tx_queue_stats tx_queues[3]; // indexed by COMM_TX_PRIO_*
+	struct budget tx_budget;
+	struct budget rx_budget;
+	uint32_t tx_push_n;
+	uint32_t tx_push_cycles; // total cpu cycles spent in push
+	uint32_t tx_push_cycles_max;
+	uint32_t tx_acks_replaced; // see comm_sendv_ack()
+	uint32_t tx_acks_dropped;
+	uint32_t tx_ack_bytes_saved;
+	uint32_t intr_off_cycles_max; // longest section with interrupts disabled
+	uint32_t isr_cycles_max;
+};
+
+// Identifies TCP flow of an ACK sent with comm_sendv_ack(), fields are
+// compared as is.
+struct comm_ack_key {
+	uint32_t src;
+	uint32_t dst;
+	uint16_t sport;
+	uint16_t dport;
+};
+
+// Payload of packet messages may be decoded straight into buffers provided
+// by application, so they don't have to be copied again. alloc() is called
+// once header of a message is decoded and returns a handle, or NULL to use
+// internal buffer (callback gets the message then). Message is passed to
+// deliver() along with the handle and its ownership. Handle of a message
+// that was lost is either reused or released with release().
+// With flow control (RTS/CTS or rx credit) every message is offered to
+// ready() first, len being buffer size still to be allocated for it (0 if
+// decoded into buffer from alloc()). If it returns false, nothing more is
+// decoded until application calls comm_rx_resume(), so host is held back
+// instead of the message being dropped.
+struct comm_rx_alloc {
+	void *(*alloc)(uint8_t type, uint8_t **buf, size_t *size);
+	void (*deliver)(uint8_t type, void *handle, uint8_t *data, uint32_t len);
+	void (*release)(void *handle);
+	bool (*ready)(uint8_t type, size_t len);
+};
+
 void comm_init(comm_callback_t cb);
-void comm_get_stats(uint32_t *, uint32_t *, uint32_t *);
+void comm_set_rx_alloc(const struct comm_rx_alloc *alloc);
+void comm_rx_resume(void);
+void comm_get_stats(struct comm_stats *);
+
+struct comm_iovec {
+	const void *base;
+	size_t len;
+};
 
 void comm_send(uint8_t, void *, size_t n, size_t);
+bool comm_sendv(uint8_t, const struct comm_iovec *, size_t iovcnt, size_t);
+bool comm_sendv_ack(uint8_t, const struct comm_iovec *, size_t iovcnt, size_t,
+                    const struct comm_ack_key *, uint32_t ack);
 void comm_send_ctl(uint8_t, void *, size_t n);
+void comm_send_ctl_id(uint8_t req_id, uint8_t, void *, size_t n);
 void comm_send_packet(uint8_t, void *, size_t n);
 void comm_send_status(uint8_t s);
 
+void comm_set_framing(uint8_t flags);
+bool comm_retransmit(uint8_t seq);
+uint8_t comm_req_id(void);
+bool comm_tx_room(size_t prio, size_t n, size_t len);
+
 extern uint8_t comm_loglevel;
 
 void comm_set_loglevel(uint8_t level);
+void comm_set_flow_control(enum flow_control_mode mode);
+bool comm_set_tx_threshold(uint8_t threshold);
+bool comm_set_tx_queue(size_t prio, uint32_t max_frames, uint32_t max_bytes,
+                       uint32_t weight);
+bool comm_set_tx_aqm(size_t prio, uint32_t target, uint32_t interval);
 
 #define PRINT_BUF_SIZE 128
 #define COMM_LOG(level, ...) do { \
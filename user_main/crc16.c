@@ -101,7 +101,13 @@ const uint16_t crc16_ccitt_tab[256] = {
 uint16_t ICACHE_FLASH_ATTR
 crc16_block(const uint8_t *buf, int len)
 {
-	uint16_t crc = CRC16_INIT_VALUE;
+	return crc16_block_update(CRC16_INIT_VALUE, buf, len);
+}
+
+/* Continue calculation of crc16 over several non-contiguous blocks */
+uint16_t ICACHE_FLASH_ATTR
+crc16_block_update(uint16_t crc, const uint8_t *buf, int len)
+{
 	int i;
 	for (i = 0; i < len; i++)
 		crc16_update(&crc, *buf++);
@@ -36,6 +36,7 @@ extern const uint16_t crc16_tab[256];
 extern const uint16_t crc16_ccitt_tab[256];
 
 unsigned short crc16_block(const uint8_t *buf, int len);
+unsigned short crc16_block_update(uint16_t crc, const uint8_t *buf, int len);
 unsigned short crc16_ccitt_block(const uint8_t *buf, int len);
 
 static void crc16_update(uint16_t *crc, uint8_t data)
@@ -43,6 +44,17 @@ static void crc16_update(uint16_t *crc, uint8_t data)
 	*crc = (*crc >> 8) ^ crc16_tab[(*crc ^ data) & 0xFF];
 }
 
+/* Four bytes at once, first byte in the least significant position */
+static inline void crc16_update_word(uint16_t *crc, uint32_t data)
+{
+	uint16_t c = *crc;
+	c = (c >> 8) ^ crc16_tab[(c ^ data) & 0xFF];
+	c = (c >> 8) ^ crc16_tab[(c ^ (data >> 8)) & 0xFF];
+	c = (c >> 8) ^ crc16_tab[(c ^ (data >> 16)) & 0xFF];
+	c = (c >> 8) ^ crc16_tab[(c ^ (data >> 24)) & 0xFF];
+	*crc = c;
+}
+
 static void crc16_ccitt_update(uint16_t *crc, uint8_t data)
 {
 	int offset = ((*crc >> 8) ^ data) & 0x00ff;
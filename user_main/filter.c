@@ -0,0 +1,371 @@
+#include "osapi.h"
+#include "c_types.h"
+#include "ets_sys.h"
+
+#include "filter.h"
+#include "comm.h"
+#include "misc.h"
+
+// Classic BPF opcodes. Supported subset is what libpcap emits for packet
+// filters: loads (abs, ind, msh, imm, len, mem), stores to scratch memory,
+// ALU, conditional jumps, tax/txa and ret. Extensions (ancillary loads)
+// are rejected.
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD   0x00
+#define BPF_LDX  0x01
+#define BPF_ST   0x02
+#define BPF_STX  0x03
+#define BPF_ALU  0x04
+#define BPF_JMP  0x05
+#define BPF_RET  0x06
+#define BPF_MISC 0x07
+
+#define BPF_W 0x00
+#define BPF_H 0x08
+#define BPF_B 0x10
+
+#define BPF_IMM 0x00
+#define BPF_ABS 0x20
+#define BPF_IND 0x40
+#define BPF_MEM 0x60
+#define BPF_LEN 0x80
+#define BPF_MSH 0xa0
+
+#define BPF_ADD 0x00
+#define BPF_SUB 0x10
+#define BPF_MUL 0x20
+#define BPF_DIV 0x30
+#define BPF_OR  0x40
+#define BPF_AND 0x50
+#define BPF_LSH 0x60
+#define BPF_RSH 0x70
+#define BPF_NEG 0x80
+#define BPF_MOD 0x90
+#define BPF_XOR 0xa0
+
+#define BPF_JA   0x00
+#define BPF_JEQ  0x10
+#define BPF_JGT  0x20
+#define BPF_JGE  0x30
+#define BPF_JSET 0x40
+
+#define BPF_K 0x00
+#define BPF_X 0x08
+#define BPF_A 0x10
+
+#define BPF_TAX 0x00
+#define BPF_TXA 0x80
+
+#define BPF_MEMWORDS 16
+
+static struct filter_insn prog[FILTER_MAX_INSNS];
+static uint32_t prog_len = 0;
+
+static uint32_t hits[FILTER_MAX_INSNS];
+static uint32_t accepted, truncated, dropped;
+
+
+static bool ICACHE_FLASH_ATTR
+insn_valid(const struct filter_insn *f, size_t pc, size_t n)
+{
+	size_t left = n - pc - 1; // instructions after this one
+
+	switch (f->code) {
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_B | BPF_MSH:
+	case BPF_LD | BPF_IMM:
+	case BPF_LDX | BPF_IMM:
+	case BPF_ALU | BPF_ADD | BPF_K:
+	case BPF_ALU | BPF_ADD | BPF_X:
+	case BPF_ALU | BPF_SUB | BPF_K:
+	case BPF_ALU | BPF_SUB | BPF_X:
+	case BPF_ALU | BPF_MUL | BPF_K:
+	case BPF_ALU | BPF_MUL | BPF_X:
+	case BPF_ALU | BPF_DIV | BPF_X:
+	case BPF_ALU | BPF_MOD | BPF_X:
+	case BPF_ALU | BPF_OR | BPF_K:
+	case BPF_ALU | BPF_OR | BPF_X:
+	case BPF_ALU | BPF_AND | BPF_K:
+	case BPF_ALU | BPF_AND | BPF_X:
+	case BPF_ALU | BPF_XOR | BPF_K:
+	case BPF_ALU | BPF_XOR | BPF_X:
+	case BPF_ALU | BPF_LSH | BPF_K:
+	case BPF_ALU | BPF_LSH | BPF_X:
+	case BPF_ALU | BPF_RSH | BPF_K:
+	case BPF_ALU | BPF_RSH | BPF_X:
+	case BPF_ALU | BPF_NEG:
+	case BPF_MISC | BPF_TAX:
+	case BPF_MISC | BPF_TXA:
+	case BPF_RET | BPF_K:
+	case BPF_RET | BPF_A:
+		return true;
+	case BPF_ALU | BPF_DIV | BPF_K:
+	case BPF_ALU | BPF_MOD | BPF_K:
+		return f->k != 0;
+	case BPF_LD | BPF_MEM:
+	case BPF_LDX | BPF_MEM:
+	case BPF_ST:
+	case BPF_STX:
+		return f->k < BPF_MEMWORDS;
+	case BPF_JMP | BPF_JA:
+		return f->k < left;
+	case BPF_JMP | BPF_JEQ | BPF_K:
+	case BPF_JMP | BPF_JEQ | BPF_X:
+	case BPF_JMP | BPF_JGT | BPF_K:
+	case BPF_JMP | BPF_JGT | BPF_X:
+	case BPF_JMP | BPF_JGE | BPF_K:
+	case BPF_JMP | BPF_JGE | BPF_X:
+	case BPF_JMP | BPF_JSET | BPF_K:
+	case BPF_JMP | BPF_JSET | BPF_X:
+		return (f->jt < left) && (f->jf < left);
+	}
+	return false;
+}
+
+// Program is checked once, at upload: only forward jumps within the program,
+// last instruction is a return, scratch memory indices are in range. Empty
+// program removes the filter.
+bool ICACHE_FLASH_ATTR
+filter_set(const struct filter_insn *insns, size_t n)
+{
+	size_t pc;
+
+	if (n > FILTER_MAX_INSNS) {
+		COMM_ERR("Filter of %d instructions is too long", (int)n);
+		return false;
+	}
+
+	for (pc = 0; pc < n; pc++) {
+		if (!insn_valid(&insns[pc], pc, n)) {
+			COMM_ERR("Bad filter instruction %d: %x", (int)pc,
+			         (int)insns[pc].code);
+			return false;
+		}
+	}
+
+	if (n && (BPF_CLASS(insns[n - 1].code) != BPF_RET)) {
+		COMM_ERR("Filter doesn't end with ret");
+		return false;
+	}
+
+	prog_len = 0;
+	os_memcpy(prog, insns, n * sizeof(*insns));
+	os_memset(hits, 0, sizeof(hits));
+	accepted = truncated = dropped = 0;
+	prog_len = n;
+	return true;
+}
+
+// Fetches `size' bytes at `off' as big-endian value. Most loads hit the
+// first segment, the rest are copied out of the chain.
+static bool ICACHE_FLASH_ATTR
+load(struct pbuf *p, uint32_t off, uint32_t size, uint32_t *val)
+{
+	uint8_t tmp[4];
+	const uint8_t *b;
+
+	if ((off >= p->tot_len) || (size > p->tot_len - off))
+		return false;
+
+	if (size <= p->len - MIN(off, p->len)) {
+		b = (const uint8_t *)p->payload + off;
+	} else {
+		pbuf_copy_partial(p, tmp, size, off);
+		b = tmp;
+	}
+
+	switch (size) {
+	case 4:
+		*val = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+		break;
+	case 2:
+		*val = (b[0] << 8) | b[1];
+		break;
+	default:
+		*val = b[0];
+	}
+	return true;
+}
+
+static uint32_t ICACHE_FLASH_ATTR
+run(struct pbuf *p)
+{
+	uint32_t a = 0, x = 0, v;
+	uint32_t mem[BPF_MEMWORDS];
+	const struct filter_insn *f;
+	size_t pc;
+
+	// Scratch memory starts zeroed as in BSD and Linux, loads before
+	// stores are allowed
+	os_memset(mem, 0, sizeof(mem));
+
+	// Program is validated, so pc can't run past the final ret
+	for (pc = 0; ; pc++) {
+		f = &prog[pc];
+
+		switch (f->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+			if (!load(p, f->k, 4, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_H | BPF_ABS:
+			if (!load(p, f->k, 2, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!load(p, f->k, 1, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+			if (!load(p, x + f->k, 4, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_H | BPF_IND:
+			if (!load(p, x + f->k, 2, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!load(p, x + f->k, 1, &a))
+				return 0;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			a = p->tot_len;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			x = p->tot_len;
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (!load(p, f->k, 1, &v))
+				return 0;
+			x = 4 * (v & 0xf);
+			break;
+		case BPF_LD | BPF_IMM:
+			a = f->k;
+			break;
+		case BPF_LDX | BPF_IMM:
+			x = f->k;
+			break;
+		case BPF_LD | BPF_MEM:
+			a = mem[f->k];
+			break;
+		case BPF_LDX | BPF_MEM:
+			x = mem[f->k];
+			break;
+		case BPF_ST:
+			mem[f->k] = a;
+			break;
+		case BPF_STX:
+			mem[f->k] = x;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K: a += f->k; break;
+		case BPF_ALU | BPF_ADD | BPF_X: a += x; break;
+		case BPF_ALU | BPF_SUB | BPF_K: a -= f->k; break;
+		case BPF_ALU | BPF_SUB | BPF_X: a -= x; break;
+		case BPF_ALU | BPF_MUL | BPF_K: a *= f->k; break;
+		case BPF_ALU | BPF_MUL | BPF_X: a *= x; break;
+		case BPF_ALU | BPF_DIV | BPF_K: a /= f->k; break;
+		case BPF_ALU | BPF_MOD | BPF_K: a %= f->k; break;
+		case BPF_ALU | BPF_OR | BPF_K: a |= f->k; break;
+		case BPF_ALU | BPF_OR | BPF_X: a |= x; break;
+		case BPF_ALU | BPF_AND | BPF_K: a &= f->k; break;
+		case BPF_ALU | BPF_AND | BPF_X: a &= x; break;
+		case BPF_ALU | BPF_XOR | BPF_K: a ^= f->k; break;
+		case BPF_ALU | BPF_XOR | BPF_X: a ^= x; break;
+		case BPF_ALU | BPF_LSH | BPF_K: a <<= f->k; break;
+		case BPF_ALU | BPF_LSH | BPF_X: a <<= x; break;
+		case BPF_ALU | BPF_RSH | BPF_K: a >>= f->k; break;
+		case BPF_ALU | BPF_RSH | BPF_X: a >>= x; break;
+		case BPF_ALU | BPF_NEG: a = -a; break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!x)
+				return 0;
+			a /= x;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!x)
+				return 0;
+			a %= x;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			pc += f->k;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			pc += (a == f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			pc += (a == x) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			pc += (a > f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			pc += (a > x) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			pc += (a >= f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			pc += (a >= x) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			pc += (a & f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			pc += (a & x) ? f->jt : f->jf;
+			break;
+
+		case BPF_MISC | BPF_TAX:
+			x = a;
+			break;
+		case BPF_MISC | BPF_TXA:
+			a = x;
+			break;
+
+		case BPF_RET | BPF_K:
+			hits[pc]++;
+			return f->k;
+		case BPF_RET | BPF_A:
+			hits[pc]++;
+			return a;
+		}
+	}
+}
+
+// Returns number of bytes of the frame to forward, 0 drops it. Frames that
+// fail a load (out of bounds, division by zero) are dropped as well.
+uint32_t ICACHE_FLASH_ATTR
+filter_run(struct pbuf *p)
+{
+	uint32_t snaplen;
+
+	if (!prog_len)
+		return FILTER_ACCEPT_ALL;
+
+	snaplen = run(p);
+	if (!snaplen)
+		dropped++;
+	else if (snaplen < p->tot_len)
+		truncated++;
+	else
+		accepted++;
+	return snaplen;
+}
+
+void ICACHE_FLASH_ATTR
+filter_get_stats(struct filter_stats *st)
+{
+	st->len = prog_len;
+	st->accepted = accepted;
+	st->truncated = truncated;
+	st->dropped = dropped;
+	os_memcpy(st->hits, hits, sizeof(hits));
+}
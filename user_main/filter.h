@@ -0,0 +1,34 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include "c_types.h"
+#include "lwip/pbuf.h"
+
+// Maximum program length, in instructions
+#define FILTER_MAX_INSNS 64
+
+// Returned by filter_run() when no program is loaded
+#define FILTER_ACCEPT_ALL 0xffffffff
+
+// Instruction layout and encoding are the ones of classic BPF (struct
+// sock_filter), so programs compiled by libpcap (`tcpdump -dd`) can be
+// loaded as is. Supported subset is listed in filter.c.
+struct filter_insn {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+} __attribute__((packed));
+
+struct filter_stats {
+	uint32_t len;       // instructions in loaded program, 0 if none
+	uint32_t accepted;  // frames passed in full
+	uint32_t truncated; // frames passed cut to snaplen
+	uint32_t dropped;
+	uint32_t hits[FILTER_MAX_INSNS]; // times each RET was taken
+};
+
+bool filter_set(const struct filter_insn *insns, size_t n);
+uint32_t filter_run(struct pbuf *p);
+void filter_get_stats(struct filter_stats *);
+
+#endif
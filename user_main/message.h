@@ -1,16 +1,10 @@
 #pragma once
 /*
-TODO:
-  - add serial numbers to detect lost packets,
-  - add id field to request and reply, and mark reply with request's id.
-    Currently if requests are sent asyncronously from different parts of
-    host program, it can be difficult to tell what reply corresponds to
-    what request.
-
 Description of communication protocol
 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 ESP8266 and host exchange messages via rs232. Default baud rate is 115200.
-Flow control isn't used, but can be implemented with CTS/RTS if required.
+Flow control isn't used by default, RTS/CTS may be enabled with
+MSG_SET_FLOW_CONTROL.
 
 Since rs232 has no inherent concept of framing, messages are packed
 using COBS framing (the project used DLC in earlier releases). Zero
@@ -21,17 +15,35 @@ to accomodate packets larger than 254 bytes, see cobs.h and cobs.c.
 Here is a short example:
   payload:        13 08 00 F0 00 00 34 A4 11
   framed data: 03 13 08 02 F0 01 04 34 A4 11 00
+Empty frames (several zero bytes in a row) carry no message and must be
+silently skipped by the receiver.
 
 Unpacked message body has following format:
-| uint8_t type | uint8_t data[] | uint16_t crc |
+| uint8_t type | header fields | uint8_t data[] | uint16_t crc |
 Multibyte integers are encoded in LE order if not specified otherwise.
 Total length must hot exceed MAX_MESSAGE_SIZE. Here is description of
 fields:
     type -- type of message, see enum command_type,
+    header fields -- optional fields enabled with MSG_SET_FRAMING,
+            absent by default (see below),
     data -- data of variable length,
     crc  -- checksum, CRC16-CCITT ("XModem" type, initialization
             value -- 0). See crc.h and crc.c for specifics.
 
+Header fields are enabled by flags of MSG_SET_FRAMING (enum framing_flags)
+and follow in this order:
+    uint8_t seq -- FRAMING_SEQ. Sequence number, incremented by 1 with
+            every message sent in given direction. Both sides start from 0
+            after MSG_SET_FRAMING. Module assigns a number even to messages
+            it drops because of congestion, so host can detect any loss.
+            Module counts gaps and late frames from host (MSG_PRINT_STATS).
+    uint8_t req_id -- FRAMING_REQ_ID. Request id, arbitrary value chosen by
+            host. Every message sent by module in response to a request,
+            including STATUS, LOG and delayed replies such as SCAN_REPLY and
+            SCAN_ENTRY, carries id of that request. Unsolicited messages
+            (packets, BOOT, etc.) have id 0. This allows host to have several
+            requests in flight.
+
 Messages of certain types are valid only when sent in a specific
 direction, e. g. WiFi configuration requests make sense only when
 sent from host to ESP8266. Some messages have no payload, some include
@@ -58,8 +70,15 @@ enum command_type {
 	/* Packet & data related messages */
 	MSG_IP_PACKET              = 0x00,
 	MSG_ETHER_PACKET           = 0x01,
+	MSG_BATCH                  = 0x02,
 	MSG_FORWARD_IP_BROADCASTS  = 0x10,
 	MSG_SET_FORWARDING_MODE    = 0x11,
+	MSG_FORWARD_ICMP_TYPES     = 0x12,
+	MSG_SET_FILTER             = 0x13,
+	MSG_SET_STEERING           = 0x14,
+	MSG_SET_PRIO_PORTS         = 0x15,
+	MSG_SET_TCP_WINDOW_CLAMP   = 0x16,
+	MSG_SET_TCP_MSS_CLAMP      = 0x17,
 
 	/* Basic WIFI messages */
 	MSG_WIFI_MODE_SET         = 0x20,
@@ -93,6 +112,13 @@ enum command_type {
 	MSG_ECHO_REQUEST           = 0x84,
 	MSG_ECHO_REPLY             = 0x85,
 	MSG_SET_BAUD               = 0x86,
+	MSG_SET_FLOW_CONTROL       = 0x87,
+	MSG_SET_FRAMING            = 0x88,
+	MSG_NACK                   = 0x89,
+	MSG_SET_TX_QUEUE           = 0x8A,
+	MSG_SET_TX_THRESHOLD       = 0x8B,
+	MSG_RX_CREDIT              = 0x8C,
+	MSG_SET_TX_AQM             = 0x8D,
 	MSG_PRINT_STATS            = 0x90,
 };
 
@@ -139,8 +165,11 @@ MSG_IP_PACKET
   dir: to/from host
   data: packet with IP header
   reply: none
-  Transmits IP packet to host or from host to network. Currently only
-  UDP/TCP are supported. This packet is valid only in IP-forwarding mode.
+  Transmits IP packet to host or from host to network. Packets from host
+  are sent with their IP header unchanged (TTL, TOS, ID, flags), so header
+  and its checksum must be complete; any protocol can be sent. UDP/TCP
+  and ICMP types selected with MSG_FORWARD_ICMP_TYPES are forwarded to
+  host. This packet is valid only in IP-forwarding mode.
 
 MSG_ETHER_PACKET
   dir: to/from host
@@ -149,6 +178,18 @@ MSG_ETHER_PACKET
   Transmits ethernet-level packets to host or from host to network. This
   type of packet is valid only in Ethernet-forwarding mode.
 
+MSG_BATCH
+  dir: to/from host
+  data: sequence of items | uint16_t len | uint8_t type | data[len] |
+  reply: none
+  Carries several small messages in one frame, saving per-frame overhead.
+  Items are dispatched in order as if they arrived in separate frames, len
+  doesn't include type byte. Header fields (seq, req_id) are present only
+  in the outer frame. Module always accepts batches from host, but sends
+  them only when FRAMING_BATCH is enabled: packets up to 128 bytes are then
+  collected while uart is busy and flushed when it becomes idle, so latency
+  isn't increased on idle link. Control messages are never batched.
+
 MSG_FORWARD_IP_BROADCASTS
   dir: from host
   data: uint8_t forward
@@ -158,6 +199,116 @@ MSG_FORWARD_IP_BROADCASTS
   sense only in IP-forwarding mode. In Ethernet mode broadcasts are not
   filtered.
 
+MSG_FORWARD_ICMP_TYPES
+  dir: from host
+  data: uint32_t types
+  reply: STATUS
+  Bitmask of ICMP types forwarded to host in IP-forwarding mode, bit N
+  selects type N (types above 31 are never forwarded). Other types are
+  handled by internal stack. Default is echo reply (0), destination
+  unreachable (3, including fragmentation needed) and time exceeded (11),
+  so host can ping, do PMTU discovery and traceroute while module still
+  answers pings itself. Any ICMP packet may be sent with MSG_IP_PACKET.
+
+MSG_SET_FILTER
+  dir: from host
+  data: struct filter_insn insns[] (see filter.h), up to 64
+  reply: STATUS
+  Loads packet filter which is run on every frame received from WLan before
+  it's forwarded to host: Ethernet frames in Ethernet mode, IP packets (from
+  IP header) in IP mode, after DHCP/broadcast/ICMP checks. Program is
+  classic BPF (struct sock_filter, little-endian), so libpcap is the
+  compiler: `tcpdump -dd EXPR` for Ethernet mode, `tcpdump -y RAW -dd EXPR`
+  for IP mode. Return value is snaplen, frame is cut to it, 0 drops frame.
+  Dropped IP packets are not passed to internal stack either. Ancillary
+  loads are not supported. Program with bad opcode or jump is rejected and
+  previous one stays. Empty payload removes the filter. Hits of each ret
+  instruction and totals are in PRINT_STATS, reset on every load.
+
+  Drop Ethernet broadcasts (Ethernet mode):
+    { 0x20, 0, 0, 0x00000002 },  ld [2]
+    { 0x15, 0, 3, 0xffffffff },  jeq #0xffffffff, L2, L5
+    { 0x28, 0, 0, 0x00000000 },  ldh [0]
+    { 0x15, 0, 1, 0x0000ffff },  jeq #0xffff, L4, L5
+    { 0x06, 0, 0, 0x00000000 },  ret #0
+    { 0x06, 0, 0, 0x0000ffff },  ret #65535
+
+  Drop mDNS and SSDP (IP mode):
+    { 0x30, 0, 0, 0x00000009 },  ldb [9]
+    { 0x15, 0, 5, 0x00000011 },  jeq #17, L2, L7
+    { 0xb1, 0, 0, 0x00000000 },  ldxb 4*([0]&0xf)
+    { 0x48, 0, 0, 0x00000002 },  ldh [x+2]
+    { 0x15, 1, 0, 0x000014e9 },  jeq #5353, L6, L5
+    { 0x15, 0, 1, 0x0000076c },  jeq #1900, L6, L7
+    { 0x06, 0, 0, 0x00000000 },  ret #0
+    { 0x06, 0, 0, 0x0000ffff },  ret #65535
+
+MSG_SET_STEERING
+  dir: from host
+  data: struct msg_steer_rule rules[], up to 32
+  reply: STATUS
+  Replaces steering table, which decides where TCP/UDP packets received
+  from WLan go in IP-forwarding mode: to host, to internal stack, to both or
+  nowhere (enum steer_action). Rule matches packets of given protocol (6,
+  17, or 0 for both) with local (destination) port in [port_lo, port_hi]
+  and remote (source) address matching `remote_addr` under `remote_mask`
+  (mask 0 matches any address). First matching rule wins. Packets that
+  match no rule go to host, except broadcasts when MSG_FORWARD_IP_BROADCASTS
+  is off. Matching rule overrides that setting, so e.g. broadcasts to a
+  single port can be forwarded. Lookup cost doesn't depend on number of
+  rules in other port ranges. Default table passes DHCP (UDP 67-68) to
+  internal stack, host that replaces the table should keep such rule if
+  module runs DHCP client or server. Hits of each rule are in PRINT_STATS.
+
+MSG_SET_PRIO_PORTS
+  dir: from host
+  data: struct msg_prio_port rules[], up to 8
+  reply: STATUS
+  Packets forwarded to host are queued with priority chosen from their
+  headers, first match wins: TCP SYN/FIN/RST, TCP without payload (ACK),
+  port rules set by this message, DSCP CS5 and above (EF included), ICMP
+  and non-IP frames (ARP, EAPOL) go to queue 1, the rest to queue 0. Rule
+  matches TCP/UDP packets of given protocol (6, 17, or 0 for both) with
+  either port in [port_lo, port_hi], and assigns priority `prio` (0 or 1),
+  so it can also demote traffic. This message replaces all rules, default
+  is DNS (UDP 53) in queue 1. Packets queued and dropped per class are
+  reported by PRINT_STATS.
+  Pure ACKs (no payload, no options but timestamps) are thinned while
+  queued: a newer cumulative ACK of the same flow replaces the queued one,
+  in place when sizes match, otherwise the old frame is skipped by the
+  transmitter, which host sees as a sequence gap with FRAMING_SEQ. Only
+  the latest 8 flows are tracked, and such ACKs are never batched.
+
+MSG_SET_TCP_WINDOW_CLAMP
+  dir: from host
+  data: uint32_t rtt, microseconds
+  reply: STATUS
+  Limits receive window of TCP connections forwarded to host, so remote
+  senders don't put more in flight than uart drains before their ACKs
+  return and transmit queues don't tail-drop. Window field of TCP segments
+  from host (MSG_IP_PACKET or MSG_ETHER_PACKET) is lowered to
+  baud / 10 * rtt bytes, at least 2920 and at most 65535, and TCP checksum
+  is updated incrementally. Window scale option is replaced by NOPs in
+  SYNs of both directions (except SYNs steered with STEER_BOTH), so only
+  connections opened after this message get exact window; windows of
+  older ones are scaled by host and end up larger. Drain rate follows MSG_SET_BAUD. rtt == 0 disables clamping
+  (default), max is 5 s. Counters are in PRINT_STATS.
+
+MSG_SET_TCP_MSS_CLAMP
+  dir: from host
+  data: struct msg_tcp_mss_clamp
+  reply: STATUS
+  Lowers MSS option of TCP SYN and SYN-ACK segments crossing `interface`
+  (0 for station, 1 for softap) to `mss`, in both directions: from host
+  (MSG_IP_PACKET or MSG_ETHER_PACKET) and from WLan to host. Both ends then
+  send segments that fit tunnels on the path, and frames from WLan stay
+  well below maximum message size, so they aren't dropped as too large.
+  TCP checksum is updated incrementally. SYNs without MSS option are left
+  as is (536 is assumed by TCP). SYNs steered to both host and module
+  (STEER_BOTH) are passed unchanged, internal stack gets the same packet.
+  mss == 0 disables clamping (default), minimum is 88. Clamped SYNs are
+  counted in PRINT_STATS.
+
 MSG_SET_FORWARDING_MODE
   dir: from host
   data: uint8_t mode
@@ -346,11 +497,117 @@ MSG_SET_BAUD
   APB base frequency is 80.0 MHz and it's divided by integer to derive UART
   frequency.
 
+MSG_SET_FLOW_CONTROL
+  dir: from host
+  data: uint8_t mode
+  reply: STATUS
+  Argument is `enum flow_control_mode` packed as `uint8_t`. New mode takes
+  effect right after reply is queued, so host should drive CTS before
+  enabling RTS/CTS mode.
+  In FLOW_CONTROL_RTS_CTS mode module stops transmitting while its CTS input
+  is inactive, and deasserts RTS when its receive buffer is 3/4 full. RTS is
+  asserted again when buffer is drained to 1/4. Host must stop sending soon
+  after RTS is deasserted, though a few hundred bytes of slack are tolerated.
+  In FLOW_CONTROL_NONE mode (default) CTS is ignored and no CTS stalls are
+  counted.
+
+MSG_SET_FRAMING
+  dir: from host
+  data: uint8_t flags
+  reply: STATUS
+  Enables optional header fields, see description of message format and
+  `enum framing_flags`. This message and its reply use the old format, all
+  following messages in both directions use the new one. Old hosts that
+  never send this message aren't affected.
+  Packets and other messages of queues 0 and 1 that are still waiting when
+  this message is handled were encoded with the old header and would be
+  sent after the STATUS reply, so they are discarded (counted per queue
+  in PRINT_STATS). Only a frame already being transmitted precedes the
+  reply. With FRAMING_SEQ a discarded message is never assigned a number
+  in the new numbering, so it doesn't show up as a gap.
+
+MSG_NACK
+  dir: from host
+  data: uint8_t seq[]
+  reply: requested messages, LOG with level WARNING for missing ones
+  Requests retransmission of control messages with given sequence numbers.
+  They're resent with their original sequence numbers. Module keeps only
+  last 8 control messages (i.e. everything except packets) with data up to
+  128 bytes. Valid only when FRAMING_SEQ is enabled.
+
+MSG_SET_TX_QUEUE
+  dir: from host
+  data: struct msg_tx_queue_conf
+  reply: STATUS
+  Module keeps a separate outgoing queue for each priority: control
+  messages (2), small packets such as TCP ACKs (1) and other packets (0).
+  Frames are sent from the highest non-empty queue, a frame being sent is
+  never interrupted. A queue with non-zero weight gets one frame through
+  after `weight` frames from higher queues were sent while it waited, so it
+  can't be starved. Frames that don't fit into max_frames / max_bytes limits
+  are dropped. Defaults are 32 frames and whole queue buffer (4096 bytes
+  for queue 0, 2048 for others), weight 0. Queue statistics are reset.
+
+MSG_SET_TX_THRESHOLD
+  dir: from host
+  data: uint8_t threshold
+  reply: STATUS
+  Uart tx fifo (126 bytes) is refilled from interrupt raised when it holds
+  less than `threshold` bytes, 0..125, default 32. The threshold should
+  cover interrupt latency at current baud rate, otherwise line goes idle
+  between refills (reported as fifo idle by MSG_PRINT_STATS). Lower values
+  mean fewer interrupts per byte.
+
+MSG_SET_TX_AQM
+  dir: from host
+  data: struct msg_tx_aqm_conf
+  reply: STATUS
+  Enables CoDel active queue management on outgoing queue 0 or 1 (control
+  queue is never managed). When frames of the queue have been waiting
+  longer than `target` us for at least `interval` us, frames are dropped
+  as they are taken for sending, at a rate growing with square root of
+  drop count, until waiting time falls below target. This keeps standing
+  queue short, so TCP senders on WLan see loss early instead of a full
+  queue. Interval 0 disables it (default). Target should be several frame
+  times at current baud, e.g. 1500 bytes take 16 ms at 921600, so target
+  50000 and interval 500000 are reasonable there. Frames dropped this way
+  are counted separately in PRINT_STATS. Queue statistics are reset.
+
+MSG_RX_CREDIT
+  dir: to host
+  data: uint32_t limit
+  reply: none
+  Sent when FRAMING_RX_CREDIT is enabled. Host counts all bytes it writes
+  to the line (encoded frames with delimiters) starting right after the
+  delimiter of MSG_SET_FRAMING frame which enabled credits, and must not
+  let the count exceed the latest `limit`. Limit only grows (modulo 2^32).
+  First credit is sent right after the STATUS reply, then whenever module
+  frees a quarter of its receive buffer, and within 250 ms of any smaller
+  change. Unchanged limit is repeated every second in case the last credit
+  was lost. Credits are not kept for retransmission (see MSG_NACK). With
+  credits host never overruns receive buffer, so no data is lost even
+  without RTS/CTS. Limit grows only as messages are taken from the buffer:
+  while a packet can't be queued for transmission to WLan (queue or buffer
+  budget is full), module stops reading and the credit is held back until
+  it can. The same applies to RTS with FLOW_CONTROL_RTS_CTS.
+
 MSG_PRINT_STATS
   dir: from host
   data: none
   reply: LOG with level INFO
-  Get some statistics in human-readable form. Currently it's only heap usage.
+  Get some statistics in human-readable form: heap usage, serial link errors,
+  rx fifo overruns, dropped outgoing packets and flow control stalls.
+  Total number of bytes sent and number of times tx fifo ran dry while data
+  was queued are reported, so host can compute line utilisation.
+  For each outgoing queue its depth, drops and queueing latency percentiles
+  are reported.
+  Buffer budgets (tx queues, rx ring, packets injected from host) are
+  reported as used/peak/limit/denied bytes, along with cpu cycles spent
+  queueing an outgoing frame. Filter and steering hits are listed as
+  index:hits, several per line, entries without hits are omitted.
+  Counters are sampled when request arrives. Report is longer than the
+  control queue, so lines are sent as the queue drains and other replies
+  may come in between. New request restarts the report.
 
 */
 
@@ -365,6 +622,18 @@ enum forwarding_mode {
 	FORWARDING_MODE_ETHER,
 } PACKED;
 
+enum flow_control_mode {
+	FLOW_CONTROL_NONE = 0,
+	FLOW_CONTROL_RTS_CTS,
+} PACKED;
+
+enum framing_flags {
+	FRAMING_SEQ = 0x01,
+	FRAMING_REQ_ID = 0x02,
+	FRAMING_BATCH = 0x04,
+	FRAMING_RX_CREDIT = 0x08,
+} PACKED;
+
 enum wifi_auth_mode {
 	WIFI_AUTH_OPEN = 0,
 	WIFI_AUTH_WEP = 1,
@@ -379,6 +648,48 @@ enum wifi_sleep_mode {
 	WIFI_SLEEP_LIGHT
 } PACKED;
 
+enum steer_action {
+	STEER_HOST = 0,
+	STEER_ESP,
+	STEER_BOTH,
+	STEER_DROP,
+} PACKED;
+
+struct msg_steer_rule {
+	uint8_t proto; /* IP protocol, 6 or 17, 0 for both */
+	uint8_t action; /* enum steer_action encoded as uint8_t */
+	uint16_t port_lo; /* local port range, inclusive */
+	uint16_t port_hi;
+	/* network order, i. e. BE */
+	uint32_t remote_addr;
+	uint32_t remote_mask;
+} PACKED;
+
+struct msg_prio_port {
+	uint8_t proto; /* IP protocol, 6 or 17, 0 for both */
+	uint8_t prio; /* queue, 0 or 1 */
+	uint16_t port_lo; /* source or destination port range, inclusive */
+	uint16_t port_hi;
+} PACKED;
+
+struct msg_tcp_mss_clamp {
+	uint8_t interface; /* 0 - station, 1 - softap */
+	uint16_t mss; /* 0 to disable */
+} PACKED;
+
+struct msg_tx_aqm_conf {
+	uint8_t prio; /* 0 or 1 */
+	uint32_t target; /* us */
+	uint32_t interval; /* us, below 2^24, 0 to disable */
+} PACKED;
+
+struct msg_tx_queue_conf {
+	uint8_t prio;
+	uint8_t max_frames; /* 1..32 */
+	uint16_t max_bytes; /* up to size of queue buffer */
+	uint8_t weight; /* 0 for strict priority */
+} PACKED;
+
 struct msg_station_conf {
 	uint8_t ssid_len;
 	uint8_t ssid[32];
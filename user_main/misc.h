@@ -3,6 +3,8 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#ifdef __XTENSA__
 // I'm not completely sure that those functions really do what they should.
 static inline uint32_t irq_save()
 {
@@ -23,3 +25,14 @@ static inline void irq_restore(uint32_t level)
 	asm volatile ("WSR.PS %0" : : "r"(ps));
 }
 
+// Cpu cycle counter, wraps every ~53 s at 80 MHz.
+static inline uint32_t get_ccount(void)
+{
+	uint32_t ccount;
+	asm volatile ("RSR %0, CCOUNT" : "=r"(ccount));
+	return ccount;
+}
+#else
+// Host-built tests link modules against a simulated SDK (test/host)
+uint32_t get_ccount(void);
+#endif
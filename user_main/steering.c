@@ -0,0 +1,106 @@
+#include "osapi.h"
+#include "c_types.h"
+
+#include "steering.h"
+#include "comm.h"
+#include "misc.h"
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+// Port space is split into buckets, each bucket has a bitmap of rules whose
+// port range overlaps it, separately for TCP and UDP. Lookup only checks
+// rules from the bitmap of packet's bucket, lowest bit (earliest rule)
+// first, so rules for other port ranges cost nothing.
+#define BUCKET_SHIFT 10
+#define BUCKETS (0x10000 >> BUCKET_SHIFT)
+
+static struct msg_steer_rule table[STEER_MAX_RULES];
+static uint32_t table_len = 0;
+static uint32_t buckets[2][BUCKETS]; // tcp, udp
+static uint32_t hits[STEER_MAX_RULES];
+
+static const struct msg_steer_rule default_rules[] = {
+	// DHCP client and server run in internal stack
+	{ IP_PROTO_UDP, STEER_ESP, 67, 68, 0, 0 },
+};
+
+
+void ICACHE_FLASH_ATTR
+steering_init(void)
+{
+	steering_set(default_rules, ARRAY_SIZE(default_rules));
+}
+
+bool ICACHE_FLASH_ATTR
+steering_set(const struct msg_steer_rule *rules, size_t n)
+{
+	size_t i, b;
+
+	if (n > STEER_MAX_RULES) {
+		COMM_ERR("Too many steering rules: %d", (int)n);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct msg_steer_rule *r = &rules[i];
+		if (((r->proto != 0) && (r->proto != IP_PROTO_TCP) &&
+		     (r->proto != IP_PROTO_UDP)) ||
+		    (r->action > STEER_DROP) || (r->port_lo > r->port_hi)) {
+			COMM_ERR("Bad steering rule %d", (int)i);
+			return false;
+		}
+	}
+
+	os_memcpy(table, rules, n * sizeof(*rules));
+	os_memset(buckets, 0, sizeof(buckets));
+	os_memset(hits, 0, sizeof(hits));
+	table_len = n;
+
+	for (i = 0; i < n; i++) {
+		const struct msg_steer_rule *r = &table[i];
+		for (b = r->port_lo >> BUCKET_SHIFT;
+		     b <= (r->port_hi >> BUCKET_SHIFT); b++) {
+			if (r->proto != IP_PROTO_UDP)
+				buckets[0][b] |= 1u << i;
+			if (r->proto != IP_PROTO_TCP)
+				buckets[1][b] |= 1u << i;
+		}
+	}
+	return true;
+}
+
+// Returns enum steer_action of the first matching rule or STEER_NO_MATCH.
+// Port is in host order, address in network order.
+int ICACHE_FLASH_ATTR
+steering_lookup(uint8_t proto, uint16_t port, uint32_t remote_addr)
+{
+	uint32_t m;
+
+	if (proto == IP_PROTO_TCP)
+		m = buckets[0][port >> BUCKET_SHIFT];
+	else if (proto == IP_PROTO_UDP)
+		m = buckets[1][port >> BUCKET_SHIFT];
+	else
+		return STEER_NO_MATCH;
+
+	while (m) {
+		size_t i = __builtin_ctz(m);
+		const struct msg_steer_rule *r = &table[i];
+
+		m &= m - 1;
+		if ((port >= r->port_lo) && (port <= r->port_hi) &&
+		    !((remote_addr ^ r->remote_addr) & r->remote_mask)) {
+			hits[i]++;
+			return r->action;
+		}
+	}
+	return STEER_NO_MATCH;
+}
+
+void ICACHE_FLASH_ATTR
+steering_get_stats(struct steer_stats *st)
+{
+	st->len = table_len;
+	os_memcpy(st->hits, hits, sizeof(hits));
+}
@@ -0,0 +1,21 @@
+#ifndef STEERING_H
+#define STEERING_H
+#include "c_types.h"
+#include "message.h"
+
+#define STEER_MAX_RULES 32
+
+// Returned by steering_lookup() when no rule matches
+#define STEER_NO_MATCH -1
+
+struct steer_stats {
+	uint32_t len; // rules in table
+	uint32_t hits[STEER_MAX_RULES];
+};
+
+void steering_init(void);
+bool steering_set(const struct msg_steer_rule *rules, size_t n);
+int steering_lookup(uint8_t proto, uint16_t port, uint32_t remote_addr);
+void steering_get_stats(struct steer_stats *);
+
+#endif
@@ -1,7 +1,3 @@
-/* TODO:
- *   - forward some ICMP types in IP-forwarding mode, e.g. ping.
- *   - AP support in Ethernet-forwarding mode.
- */
 #include "user_interface.h"
 
 #include "ets_sys.h"
@@ -13,10 +9,17 @@
 #include "lwip/ip_addr.h"
 #include "lwip/raw.h"
 #include "lwip/udp.h"
+#include "lwip/icmp.h"
 #include "netif/wlan_lwip_if.h"
+#include "netif/etharp.h"
 
 #include "comm.h"
 #include "misc.h"
+#include "budget.h"
+#include "filter.h"
+#include "steering.h"
+#include "classify.h"
+#include "clamp.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -25,13 +28,59 @@
 #define TASK_QUEUE_LEN 4
 os_event_t *taskQueue;
 
+#define INJECT_TASK_PRIO USER_TASK_PRIO_1
+#define SIG_INJECT 0
+#define INJECT_QUEUE_LEN 8 /* power of 2 */
+#define SOFTAP_CLIENTS_MAX 8 /* most the SDK lets associate */
+
 #define UART0   0
 #define UART1   1
 #define MAX_PACKET_SIZE 1600
+#define MAX_PBUF_SEGMENTS 8
+#define INJECT_BUDGET (6 * MAX_PACKET_SIZE)
+#define RX_PBUF_SIZE (MAX_PACKET_SIZE + 2) /* packet and crc */
 
 static uint8_t forward_ip_broadcasts = 1;
+// Bit per ICMP type forwarded to host, the rest is handled by internal stack
+// (so it keeps answering pings unless ICMP_ECHO is selected).
+static uint32_t forward_icmp_types =
+	(1 << ICMP_ER) | (1 << ICMP_DUR) | (1 << ICMP_TE);
+static uint8_t scan_req_id = 0;
 static enum forwarding_mode global_forwarding_mode = FORWARDING_MODE_NONE;
 
+// Heap taken by packets from host. Only our reference is accounted, lwip may
+// keep a packet a bit longer (e.g. while waiting for ARP reply).
+static struct budget inject_budget;
+
+// Cost of injection, packets decoded directly into pbuf vs copied
+struct inject_stats {
+	uint32_t n;
+	uint32_t cycles;
+	uint32_t cycles_max;
+};
+
+static struct inject_stats inject_direct_stats;
+static struct inject_stats inject_copy_stats;
+
+// Packets from host are handed over to injection task, so radio transmit
+// never runs in comm task and never with interrupts disabled. Producer is
+// comm task, consumer is injection task, indices are free-running.
+struct inject_item {
+	struct pbuf *p;
+	uint16_t charge; /* size charged to inject_budget */
+	uint8_t type;
+};
+
+static struct inject_item inject_queue[INJECT_QUEUE_LEN];
+static volatile uint32_t inject_read_i = 0;
+static volatile uint32_t inject_write_i = 0;
+static volatile bool inject_task_pending = false;
+static os_event_t inject_task_queue[1];
+static uint32_t inject_queue_drops = 0;
+static bool inject_rx_held = false; // comm waits for queue to drain
+static struct inject_stats inject_send_stats[2]; // ip, ether
+static uint32_t inject_no_route = 0;
+
 
 void ICACHE_FLASH_ATTR user_pre_init(void)
 {
@@ -63,54 +112,151 @@ void ICACHE_FLASH_ATTR user_pre_init(void)
 }
 
 
+/* Original netif callbacks, one slot per SDK interface (STATION_IF and
+   SOFTAP_IF). Filled by hook_netif() from the wifi event handler, the
+   mitm callbacks find their slot by the netif pointer. */
+struct netif_hook {
+	struct netif *netif;
+	netif_input_fn input;
+	netif_output_fn output;
+	netif_linkoutput_fn linkoutput;
+};
+
+static struct netif_hook netif_hooks[2];
+
+static struct netif_hook *netif_hook_find(struct netif *netif)
+{
+	if (netif_hooks[STATION_IF].netif == netif)
+		return &netif_hooks[STATION_IF];
+	if (netif_hooks[SOFTAP_IF].netif == netif)
+		return &netif_hooks[SOFTAP_IF];
+	return NULL;
+}
+
+// STATION_IF or SOFTAP_IF, -1 if netif isn't hooked
+static int netif_index(struct netif *netif)
+{
+	struct netif_hook *h = netif_hook_find(netif);
+	return h ? h - netif_hooks : -1;
+}
+
+// Forwards first len bytes of pbuf chain to host segment by segment,
+// without linearizing it. Pure ACKs may replace a queued ACK of their flow.
+static bool ICACHE_FLASH_ATTR
+send_pbuf(uint8_t type, struct pbuf *p, size_t len, size_t prio,
+          const struct pkt_info *pi)
+{
+	struct comm_iovec iov[MAX_PBUF_SEGMENTS];
+	size_t n = 0;
+
+	for (; p && len && (n < ARRAY_SIZE(iov)); p = p->next, n++) {
+		iov[n].base = p->payload;
+		iov[n].len = MIN(p->len, len);
+		len -= iov[n].len;
+	}
+
+	if (len) {
+		COMM_ERR("Packet has too many segments");
+		return false;
+	}
+
+	if (pi->ack_only) {
+		struct comm_ack_key key = {
+			.src = pi->src,
+			.dst = pi->dst,
+			.sport = pi->sport,
+			.dport = pi->dport,
+		};
+		return comm_sendv_ack(type, iov, n, prio, &key, pi->ack);
+	}
+
+	return comm_sendv(type, iov, n, prio);
+}
+
+// Runs filter and queues the packet with priority of its class. pbuf is
+// not freed. if_index is interface packet came from. Shared pbuf goes to
+// internal stack as well and must stay as received, so its SYN options
+// aren't clamped.
+static void ICACHE_FLASH_ATTR
+forward_pbuf(uint8_t type, struct pbuf *p, struct pkt_info *pi, int if_index,
+             bool shared)
+{
+	uint32_t len = MIN(filter_run(p), p->tot_len);
+	size_t prio;
+
+	if (!len) {
+		COMM_DBG("Packet dropped by filter");
+		return;
+	}
+
+	if (len > MAX_PACKET_SIZE) {
+		COMM_WARN("IP packet too large: %d", (int)len);
+		return;
+	}
+
+	if (!shared)
+		clamp_input(p, type == MSG_ETHER_PACKET, if_index);
+	prio = classify(pi);
+	classify_count(pi, send_pbuf(type, p, len, prio, pi));
+}
+
+
 static u8_t ICACHE_FLASH_ATTR
 raw_receiver(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
 {
-	struct ip_hdr hdr;
+	struct pkt_info pi;
+	int action = STEER_NO_MATCH;
 
 	COMM_DBG("WLan IP packet of size %d", p->tot_len);
 	if (global_forwarding_mode != FORWARDING_MODE_IP)
 		return 0;
 
-	if (pbuf_copy_partial(p, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+	if (!classify_parse(p, false, &pi)) {
 		COMM_WARN("WLan packet of size %d has incomplete header",
 			  p->tot_len);
 		return 0;
 	}
 
-	if (!forward_ip_broadcasts && (hdr.dest.addr == 0xffffffff)) {
-		COMM_DBG("Passing broadcast to internal stack");
-		return 0;
-	}
+	if ((pi.proto == IP_PROTO_TCP) || (pi.proto == IP_PROTO_UDP))
+		action = steering_lookup(pi.proto, pi.dport, pi.src);
 
-	if ((hdr._proto == IP_PROTO_UDP)) {
-		int offset = 4 * IPH_HL(&hdr);
-		struct udp_hdr udp_h;
-		if (!pbuf_copy_partial(p, &udp_h, sizeof(udp_h), offset)) {
-			COMM_WARN("Can't copy UDP header from WLan packet");
+	if (action == STEER_NO_MATCH) {
+		if (!forward_ip_broadcasts && (pi.dst == 0xffffffff)) {
+			COMM_DBG("Passing broadcast to internal stack");
 			return 0;
 		}
-		uint16_t src = ntohs(udp_h.src);
-		uint16_t dst = ntohs(udp_h.dest);
-		if ((src == 67) || (dst == 67) || (src == 68) || (dst == 68)) {
-			COMM_DBG("Got DHCP packet, passing it to internal stack");
+		action = STEER_HOST;
+	}
+
+	if (pi.proto == IP_PROTO_ICMP) {
+		if ((pi.icmp_type >= 32) ||
+		    !(forward_icmp_types & (1 << pi.icmp_type))) {
+			COMM_DBG("Passing ICMP type %d to internal stack",
+			         (int)pi.icmp_type);
 			return 0;
 		}
 	}
 
-	if (p->next) {
-		// it's possible to handle this case but I've not seen it yet
-		COMM_ERR("internal error: got scattered packet");
-	} else {
-		if (p->len > MAX_PACKET_SIZE) {
-			COMM_WARN("IP packet too large: %d", (int) p->len);
-		} else {
-			// TCP ACKs should be 48 bytes
-			size_t prio = (p->len < 48 + 20) ? COMM_TX_PRIO_MEDIUM : COMM_TX_PRIO_LOW;
-			comm_send(MSG_IP_PACKET, p->payload, p->len, prio);
-		}
+	if (action == STEER_ESP) {
+		COMM_DBG("Passing packet to internal stack");
+		return 0;
+	}
+
+	if (action == STEER_DROP) {
+		COMM_DBG("Packet dropped by steering rule");
+		pbuf_free(p);
+		return 1;
 	}
 
+	// Packets dropped by filter are consumed too, internal stack would
+	// answer them
+	forward_pbuf(MSG_IP_PACKET, p, &pi,
+	             netif_index(ip_current_netif()), action == STEER_BOTH);
+
+	// packet was copied, internal stack gets it as well
+	if (action == STEER_BOTH)
+		return 0;
+
 	pbuf_free(p);
 	return 1;
 	/* return 0; // not processed */
@@ -118,10 +264,7 @@ raw_receiver(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
 
 static struct raw_pcb *raw_pcb_tcp = NULL;
 static struct raw_pcb *raw_pcb_udp = NULL;
-
-static volatile netif_input_fn netif_input_orig = NULL;
-static volatile netif_output_fn netif_output_orig = NULL;
-static volatile netif_linkoutput_fn netif_linkoutput_orig = NULL;
+static struct raw_pcb *raw_pcb_icmp = NULL;
 
 static void ICACHE_FLASH_ATTR
 init_wlan() {
@@ -151,14 +294,17 @@ init_wlan() {
 
 	raw_pcb_tcp = raw_new(6);
 	raw_pcb_udp = raw_new(17);
-	if (!raw_pcb_tcp || !raw_pcb_udp) {
+	raw_pcb_icmp = raw_new(1);
+	if (!raw_pcb_tcp || !raw_pcb_udp || !raw_pcb_icmp) {
 		COMM_DBG("Failed to init raw sockets");
 	} else {
 		// todo: check errors
 		raw_bind(raw_pcb_tcp, IP_ADDR_ANY);
 		raw_bind(raw_pcb_udp, IP_ADDR_ANY);
+		raw_bind(raw_pcb_icmp, IP_ADDR_ANY);
 		raw_recv(raw_pcb_tcp, raw_receiver, NULL);
 		raw_recv(raw_pcb_udp, raw_receiver, NULL);
+		raw_recv(raw_pcb_icmp, raw_receiver, NULL);
 	}
 }
 
@@ -168,24 +314,18 @@ static err_t netif_input_mitm(struct pbuf *p, struct netif *netif)
 	COMM_DBG("mitm input, size=%d", (int)p->tot_len);
 
 	if (global_forwarding_mode == FORWARDING_MODE_ETHER) {
-		if (p->next) {
-			// it's possible to handle this case but I've not seen it yet
-			COMM_ERR("internal error: got scattered packet");
-		} else {
-			if (p->len > MAX_PACKET_SIZE) {
-				COMM_WARN("IP packet too large: %d", (int) p->len);
-			} else {
-				// TCP ACKs should be around 68 bytes with eth header
-				size_t prio = (p->len < 68 + 20) ?
-					COMM_TX_PRIO_MEDIUM : COMM_TX_PRIO_LOW;
-				comm_send(MSG_ETHER_PACKET, p->payload, p->len, prio);
-			}
-		}
+		// malformed frames are still forwarded, classified by what
+		// could be parsed
+		struct pkt_info pi;
+		classify_parse(p, true, &pi);
+		forward_pbuf(MSG_ETHER_PACKET, p, &pi, netif_index(netif),
+		             false);
 		pbuf_free(p);
 		return 0;
 	} else {
-		if (netif_input_orig)
-			return netif_input_orig(p, netif);
+		struct netif_hook *h = netif_hook_find(netif);
+		if (h && h->input)
+			return h->input(p, netif);
 
 		COMM_WARN("mitm input zero pointer");
 		return 0;
@@ -199,8 +339,9 @@ static err_t netif_output_mitm(struct netif *netif, struct pbuf *p, ip_addr_t *i
 	if (global_forwarding_mode == FORWARDING_MODE_ETHER)
 		return 0;
 
-	if (netif_output_orig)
-		return netif_output_orig(netif, p, ipaddr);
+	struct netif_hook *h = netif_hook_find(netif);
+	if (h && h->output)
+		return h->output(netif, p, ipaddr);
 
 	COMM_WARN("mitm output zero pointer");
 	return 0;
@@ -213,136 +354,421 @@ static err_t netif_linkoutput_mitm(struct netif *netif, struct pbuf *p)
 	if (global_forwarding_mode == FORWARDING_MODE_ETHER)
 		return 0;
 
-	if (netif_linkoutput_orig)
-		return netif_linkoutput_orig(netif, p);
+	struct netif_hook *h = netif_hook_find(netif);
+	if (h && h->linkoutput)
+		return h->linkoutput(netif, p);
 
 	COMM_WARN("mitm linkoutput zero pointer");
 	return 0;
 }
 
-static void mitm_interface()
+/* Stations associated with our softap, kept from wifi events, so frames
+   from host addressed to them can be sent through softap */
+static uint8_t softap_clients[SOFTAP_CLIENTS_MAX][ETHARP_HWADDR_LEN];
+static size_t softap_clients_n = 0;
+
+static int ICACHE_FLASH_ATTR
+softap_client_find(const uint8_t *mac)
+{
+	size_t i;
+
+	for (i = 0; i < softap_clients_n; i++)
+		if (!memcmp(softap_clients[i], mac, ETHARP_HWADDR_LEN))
+			return i;
+	return -1;
+}
+
+static void ICACHE_FLASH_ATTR
+softap_client_add(const uint8_t *mac)
 {
-	/* TODO: use STATION_IF / SOFTAP_IF defines depending on operation
-	   mode. Currently ethernet forwad functionality is tested only
-	   in STA mode. */
-	struct netif *netif = eagle_lwip_getif(0);
+	if ((softap_client_find(mac) >= 0) ||
+	    (softap_clients_n == SOFTAP_CLIENTS_MAX))
+		return;
+	memcpy(softap_clients[softap_clients_n++], mac, ETHARP_HWADDR_LEN);
+}
+
+static void ICACHE_FLASH_ATTR
+softap_client_del(const uint8_t *mac)
+{
+	int i = softap_client_find(mac);
+
+	if (i >= 0)
+		memcpy(softap_clients[i], softap_clients[--softap_clients_n],
+		       ETHARP_HWADDR_LEN);
+}
+
+/* The SDK creates the netif when the interface is brought up, may
+   recreate it on reconnect and frees it when the interface leaves the
+   opmode, so hooking is driven by wifi events instead of being checked on
+   every packet. Ethernet frames can't reach the interface before the
+   connect event, so none bypass the mitm. When the interface is disabled
+   its slot is cleared, saved callbacks belong to a freed netif. */
+static void ICACHE_FLASH_ATTR
+hook_netif(uint8_t if_index)
+{
+	struct netif_hook *h = &netif_hooks[if_index];
+	struct netif *netif = eagle_lwip_getif(if_index);
 	if (!netif) {
-		COMM_DBG("mitm_interface: netif not ready");
+		COMM_DBG("hook_netif %d: netif not ready", (int)if_index);
 		return;
 	}
 
+	if (h->netif != netif) {
+		/* new netif, callbacks saved for the old one are stale */
+		h->input = NULL;
+		h->output = NULL;
+		h->linkoutput = NULL;
+		h->netif = netif;
+	}
+
 	if (netif->input != netif_input_mitm) {
-		COMM_INFO("mitm_interface: input %x",
+		COMM_INFO("hook_netif %d: input %x", (int)if_index,
 			  (uint32_t)((void *)netif->input));
-		netif_input_orig = netif->input;
+		h->input = netif->input;
 		netif->input = netif_input_mitm;
 	}
 
 	if (netif->output != netif_output_mitm) {
-		COMM_INFO("mitm_interface: output %x",
+		COMM_INFO("hook_netif %d: output %x", (int)if_index,
 			  (uint32_t)((void *)netif->output));
-		netif_output_orig = netif->output;
+		h->output = netif->output;
 		netif->output = netif_output_mitm;
 	}
 
 	if (netif->linkoutput != netif_linkoutput_mitm) {
-		COMM_INFO("mitm_interface: linkoutput %x",
+		COMM_INFO("hook_netif %d: linkoutput %x", (int)if_index,
 			  (uint32_t)((void *)netif->linkoutput));
-		netif_linkoutput_orig = netif->linkoutput;
+		h->linkoutput = netif->linkoutput;
 		netif->linkoutput = netif_linkoutput_mitm;
 	}
 }
 
+static void ICACHE_FLASH_ATTR
+unhook_netif(uint8_t if_index)
+{
+	struct netif_hook *h = &netif_hooks[if_index];
+
+	if (h->netif)
+		COMM_INFO("unhook_netif %d", (int)if_index);
+	h->netif = NULL;
+	h->input = NULL;
+	h->output = NULL;
+	h->linkoutput = NULL;
+}
+
+// Slot can be used for output only while it belongs to the current netif
+static bool ICACHE_FLASH_ATTR
+netif_hook_live(struct netif_hook *h)
+{
+	return h->linkoutput &&
+	       (h->netif == eagle_lwip_getif(h - netif_hooks));
+}
+
+static void ICACHE_FLASH_ATTR
+wifi_event_cb(System_Event_t *e)
+{
+	switch (e->event) {
+	case EVENT_STAMODE_CONNECTED:
+	case EVENT_STAMODE_GOT_IP:
+		hook_netif(STATION_IF);
+		break;
+	case EVENT_SOFTAPMODE_STACONNECTED:
+		softap_client_add(e->event_info.sta_connected.mac);
+		hook_netif(SOFTAP_IF);
+		break;
+	case EVENT_SOFTAPMODE_STADISCONNECTED:
+		softap_client_del(e->event_info.sta_disconnected.mac);
+		break;
+	case EVENT_OPMODE_CHANGED:
+		if (wifi_get_opmode() & STATION_MODE)
+			hook_netif(STATION_IF);
+		else
+			unhook_netif(STATION_IF);
+		if (wifi_get_opmode() & SOFTAP_MODE) {
+			hook_netif(SOFTAP_IF);
+		} else {
+			unhook_netif(SOFTAP_IF);
+			softap_clients_n = 0;
+		}
+		break;
+	}
+}
+
+static struct pbuf * ICACHE_FLASH_ATTR
+inject_pbuf_alloc(pbuf_layer layer, int n)
+{
+	struct pbuf *p;
+
+	if (!budget_take(&inject_budget, n))
+		return NULL;
+
+	p = pbuf_alloc(layer, n, PBUF_RAM);
+	if (!p)
+		budget_give(&inject_budget, n);
+	return p;
+}
+
+/* n is size the pbuf was allocated with */
+static void ICACHE_FLASH_ATTR
+inject_pbuf_free(struct pbuf *p, int n)
+{
+	budget_give(&inject_budget, n);
+	pbuf_free(p);
+}
+
+static void ICACHE_FLASH_ATTR
+inject_stats_add(struct inject_stats *st, uint32_t cycles)
+{
+	st->n++;
+	st->cycles += cycles;
+	if (cycles > st->cycles_max)
+		st->cycles_max = cycles;
+}
+
+/* Packet with IP header built by host. Header is sent as is (TTL, TOS,
+   ID and flags are preserved and any protocol goes), lwip only routes
+   it and resolves link address. pbuf should have PBUF_LINK headroom. */
 static int ICACHE_FLASH_ATTR
-inject_ip_packet(uint8_t *data, int n)
+inject_ip_pbuf(struct pbuf *p)
 {
-	struct ip_hdr hdr;
+	struct ip_hdr *hdr = p->payload;
+	struct netif *netif;
 	ip_addr_t dest;
-	uint8_t *payload;
 	int hl;
-	struct pbuf *p;
-        struct raw_pcb *pcb;
-	int status;
 
-	/* uint32_t ps; */
-	/* asm("RSR %0, PS" : "=r"(ps)); */
-	/* COMM_INFO("IRQ level (inject_packet): %d", (int)ps); */
+	if (p->len < sizeof(*hdr)) {
+		COMM_ERR("Packet of size %d is too short", p->len);
+		return -1;
+	}
 
-	if (n < sizeof(hdr)) {
-		COMM_ERR("Packet of size %d is too short", n);
+	hl = 4 * IPH_HL(hdr);
+	if ((IPH_V(hdr) != 4) || (hl < sizeof(*hdr)) || (hl > p->len)) {
+		COMM_ERR("Bad IP header: v=%d, hl=%d, dl=%d",
+		         (int)IPH_V(hdr), hl, p->len);
 		return -1;
 	}
-	memcpy(&hdr, data, sizeof(hdr));
 
-	if ((hdr._proto != IP_PROTO_TCP) && (hdr._proto != IP_PROTO_UDP)) {
-		COMM_ERR("Proto %d is not supported", hdr._proto);
+	ip_addr_copy(dest, hdr->dest);
+	netif = ip_route(&dest);
+	if (!netif) {
+		COMM_DBG("No route to %x", (uint32_t)dest.addr);
+		inject_no_route++;
 		return -1;
 	}
 
-	hl = 4 * IPH_HL(&hdr);
-	if (hl > n) {
-		COMM_ERR("Header is larger than data: hl=%d, dl=%d", hl, n);
+	clamp_output(p, false, netif_index(netif));
+
+	return ip_output_if(p, NULL, IP_HDRINCL, 0, 0, 0, netif);
+}
+
+static void ICACHE_FLASH_ATTR
+ether_output(struct netif_hook *h, struct pbuf *p)
+{
+	clamp_output(p, true, h - netif_hooks);
+	h->linkoutput(h->netif, p);
+}
+
+/* Called from injection task, same context lwip uses for output. Frames
+   addressed to softap clients leave through softap, other unicast through
+   station (softap if it's the only one up), broadcast and multicast through
+   both. */
+static int ICACHE_FLASH_ATTR
+inject_ether_pbuf(struct pbuf *p)
+{
+	struct netif_hook *sta = &netif_hooks[STATION_IF];
+	struct netif_hook *ap = &netif_hooks[SOFTAP_IF];
+	const uint8_t *dst = p->payload;
+	bool sta_up = netif_hook_live(sta);
+	bool ap_up = netif_hook_live(ap);
+	bool group, to_ap, to_sta;
+
+	if (p->len < ETHARP_HWADDR_LEN) {
+		COMM_ERR("Ether frame of size %d is too short", p->len);
 		return -1;
 	}
-	payload = data + hl;
-	n -= hl;
 
-	p = pbuf_alloc(PBUF_IP, n, PBUF_RAM);
-	if (!p) {
-		COMM_ERR("Failed to allocate packet of size %d", n);
+	if (!sta_up && !ap_up) {
+		COMM_WARN("netif isn't hooked yet");
 		return -1;
 	}
-	memcpy(p->payload, payload, n);
-	p->tot_len = n;
-	p->len = n;
 
-	pcb = hdr._proto == 6 ? raw_pcb_tcp : raw_pcb_udp;
-	dest.addr = hdr.dest.addr;
-	status = raw_sendto(pcb, p, &dest);
-	pbuf_free(p);
-	return status;
+	group = dst[0] & 1;
+	to_ap = ap_up &&
+		(group || !sta_up || (softap_client_find(dst) >= 0));
+	to_sta = sta_up && (group || !to_ap);
+
+	/* Driver may prepend its headers in place, softap gets a copy */
+	if (to_ap && to_sta) {
+		struct pbuf *q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+
+		if (q && (pbuf_copy(q, p) == ERR_OK))
+			ether_output(ap, q);
+		else
+			COMM_WARN("Failed to copy frame for softap");
+		if (q)
+			pbuf_free(q);
+	}
+
+	ether_output(to_sta ? sta : ap, p);
+	return 0;
 }
 
-/* This funtion is called from UART interrupt, so I hope interface won't die
- *
- */
-static int ICACHE_FLASH_ATTR
-inject_ether_packet(uint8_t *data, int n)
+static void ICACHE_FLASH_ATTR
+inject_task(os_event_t *e)
 {
-	uint32_t irq_level = irq_save();
+	inject_task_pending = false;
+
+	while (inject_read_i != inject_write_i) {
+		struct inject_item *it =
+			&inject_queue[inject_read_i & (INJECT_QUEUE_LEN - 1)];
+		bool ip = it->type == MSG_IP_PACKET;
+		uint32_t cycles = get_ccount();
+
+		if (ip)
+			inject_ip_pbuf(it->p);
+		else
+			inject_ether_pbuf(it->p);
+
+		inject_stats_add(&inject_send_stats[ip ? 0 : 1],
+		                 get_ccount() - cycles);
 
-	if (!netif_linkoutput_orig) {
-		COMM_WARN("netif_linkoutput_orig is zero");
-		goto fail;
+		inject_pbuf_free(it->p, it->charge);
+		inject_read_i++;
 	}
 
-	struct netif *netif = eagle_lwip_getif(0);
-	if (!netif) {
-		COMM_WARN("netif doesn't exist yet");
-		goto fail;
+	if (inject_rx_held) {
+		inject_rx_held = false;
+		comm_rx_resume();
 	}
+}
+
+/* Takes ownership of the pbuf */
+static void ICACHE_FLASH_ATTR
+inject_enqueue(uint8_t type, struct pbuf *p, uint16_t charge)
+{
+	struct inject_item *it;
+
+	if (inject_write_i - inject_read_i == INJECT_QUEUE_LEN) {
+		inject_queue_drops++;
+		inject_pbuf_free(p, charge);
+		return;
+	}
+
+	it = &inject_queue[inject_write_i & (INJECT_QUEUE_LEN - 1)];
+	it->p = p;
+	it->charge = charge;
+	it->type = type;
+	inject_write_i++;
+
+	if (!inject_task_pending) {
+		inject_task_pending = true;
+		system_os_post(INJECT_TASK_PRIO, SIG_INJECT, 0);
+	}
+}
 
-	struct pbuf *p = pbuf_alloc(PBUF_RAW, n, PBUF_RAM);
+/* Packets which were not decoded into pbuf, e.g. from MSG_BATCH */
+static int ICACHE_FLASH_ATTR
+inject_packet(uint8_t type, uint8_t *data, int n)
+{
+	pbuf_layer layer = (type == MSG_IP_PACKET) ? PBUF_LINK : PBUF_RAW;
+	uint32_t cycles = get_ccount();
+	struct pbuf *p;
+
+	p = inject_pbuf_alloc(layer, n);
 	if (!p) {
 		COMM_ERR("Failed to allocate packet of size %d", n);
-		goto fail;
+		return -1;
 	}
 	memcpy(p->payload, data, n);
-	p->tot_len = n;
-	p->len = n;
+	inject_enqueue(type, p, n);
 
-	netif_linkoutput_orig(netif, p);
-	pbuf_free(p);
+	inject_stats_add(&inject_copy_stats, get_ccount() - cycles);
+	return 0;
+}
 
-	irq_restore(irq_level);
+static bool ICACHE_FLASH_ATTR
+packet_mode_ok(uint8_t type)
+{
+	if ((type == MSG_IP_PACKET) &&
+	    (global_forwarding_mode == FORWARDING_MODE_IP))
+		return true;
+	if ((type == MSG_ETHER_PACKET) &&
+	    (global_forwarding_mode == FORWARDING_MODE_ETHER))
+		return true;
+	return false;
+}
 
-	/* COMM_INFO("***** sent %d bytes to linkoutput", n); */
-	return 0;
-fail:
-	irq_restore(irq_level);
-	return -1;
+/* Payload of packets from host is decoded by comm straight into pbufs */
+static void * ICACHE_FLASH_ATTR
+rx_pbuf_alloc(uint8_t type, uint8_t **buf, size_t *size)
+{
+	struct pbuf *p;
+
+	if (!packet_mode_ok(type))
+		return NULL;
+
+	p = inject_pbuf_alloc(type == MSG_IP_PACKET ? PBUF_LINK : PBUF_RAW,
+	                      RX_PBUF_SIZE);
+	if (!p)
+		return NULL;
+
+	*buf = p->payload;
+	*size = p->len;
+	return p;
 }
 
+static void ICACHE_FLASH_ATTR
+rx_pbuf_release(void *handle)
+{
+	inject_pbuf_free(handle, RX_PBUF_SIZE);
+}
+
+static void ICACHE_FLASH_ATTR
+rx_pbuf_deliver(uint8_t type, void *handle, uint8_t *data, uint32_t n)
+{
+	struct pbuf *p = handle;
+	uint32_t cycles = get_ccount();
+
+	if (!packet_mode_ok(type)) {
+		COMM_ERR("Cannot forward packet %d in mode %d",
+		         (int)type, (int)global_forwarding_mode);
+	} else if (!n || (n > MAX_PACKET_SIZE)) {
+		COMM_ERR("Wrong packet size %d", (int)n);
+	} else {
+		pbuf_realloc(p, n);
+		inject_enqueue(type, p, RX_PBUF_SIZE);
+		inject_stats_add(&inject_direct_stats, get_ccount() - cycles);
+		return;
+	}
+
+	inject_pbuf_free(p, RX_PBUF_SIZE);
+}
+
+/* Packet is taken only if it can be queued for injection, otherwise comm
+   stops reading data from host until inject task frees some space */
+static bool ICACHE_FLASH_ATTR
+rx_pbuf_ready(uint8_t type, size_t len)
+{
+	// Nothing would resume comm if queue was empty, budget is then free
+	// anyway except for a buffer being decoded into
+	if (!packet_mode_ok(type) || (inject_write_i == inject_read_i))
+		return true;
+
+	if ((inject_write_i - inject_read_i < INJECT_QUEUE_LEN) &&
+	    (inject_budget.limit - inject_budget.used >= len))
+		return true;
+
+	inject_rx_held = true;
+	return false;
+}
+
+static const struct comm_rx_alloc rx_pbuf_ops = {
+	.alloc = rx_pbuf_alloc,
+	.deliver = rx_pbuf_deliver,
+	.release = rx_pbuf_release,
+	.ready = rx_pbuf_ready,
+};
+
 static void ICACHE_FLASH_ATTR
 scan_done(void *arg, STATUS status)
 {
@@ -356,7 +782,6 @@ scan_done(void *arg, STATUS status)
 	if (status != OK) {
 		r.status = 255;
 		r.entries_n = 0;
-		return;
 	} else {
 		r.status = 0;
 		r.entries_n = 0;
@@ -366,7 +791,7 @@ scan_done(void *arg, STATUS status)
 			bss_iter = bss_iter->next.stqe_next;
 		}
 	}
-	comm_send_ctl(MSG_WIFI_SCAN_REPLY, &r, sizeof(r));
+	comm_send_ctl_id(scan_req_id, MSG_WIFI_SCAN_REPLY, &r, sizeof(r));
 	if (r.status) {
 		COMM_ERR("Scan failed");
 		return;
@@ -386,7 +811,8 @@ scan_done(void *arg, STATUS status)
 		e.is_hidden = bss_iter->is_hidden;
 		bss_iter = bss_iter->next.stqe_next;
 
-		comm_send_ctl(MSG_WIFI_SCAN_ENTRY, (void *) &e, sizeof(e));
+		comm_send_ctl_id(scan_req_id, MSG_WIFI_SCAN_ENTRY,
+		                 (void *) &e, sizeof(e));
 	}
 }
 
@@ -402,27 +828,234 @@ scan_done(void *arg, STATUS status)
 	return; \
 } while(0)
 
+// Reply to MSG_PRINT_STATS is longer than the control queue, so it's sent
+// in parts: counters are snapshotted when request arrives and lines are
+// queued only while there is room for them, with a spare slot left for
+// other control messages. Rest is sent from a timer as the queue drains.
+#define STATS_RETRY_MS 10
+// Filter and steering hits per line, as "index:hits"
+#define STATS_HITS_PER_LINE 6
+
+static struct {
+	struct comm_stats st;
+	struct filter_stats fst;
+	struct steer_stats sst;
+	struct classify_stats cst;
+	struct clamp_stats cl;
+	struct budget inject_budget;
+	struct inject_stats inject[2];  // direct, copied
+	struct inject_stats send[2];    // ip, ether
+	uint32_t inject_queue_drops;
+	uint32_t inject_no_route;
+	uint32_t heap_free;
+	uint8_t req_id;
+	size_t line;                    // next line to send
+	os_timer_t timer;
+} stats;
+
+static size_t ICACHE_FLASH_ATTR
+stats_hits_lines(const uint32_t *hits, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++)
+		if (hits[i])
+			n++;
+	return (n + STATS_HITS_PER_LINE - 1) / STATS_HITS_PER_LINE;
+}
+
+// Formats page-th group of non-zero entries of hits
 static void ICACHE_FLASH_ATTR
-packet_from_host(uint8_t type, uint8_t *data, uint32_t n)
+stats_hits_line(char *buf, const char *name, const uint32_t *hits, size_t len,
+                size_t page)
+{
+	size_t i, k = 0;
+
+	buf += os_sprintf(buf, "%s hits:", name);
+	for (i = 0; i < len; i++) {
+		if (!hits[i])
+			continue;
+		if (k++ / STATS_HITS_PER_LINE == page)
+			buf += os_sprintf(buf, " %d:%d", (int)i, (int)hits[i]);
+	}
+}
+
+// Formats line-th line of the report into buf, returns false past the end
+static bool ICACHE_FLASH_ATTR
+stats_line(size_t line, char *buf)
 {
-	/* It's not clear how to intercept the exact moment when interface is
-	   set up (it's not done on bootup). So we'll try to do it on every
-	   message from host.
-	   TODO: maybe use a timer instead? */
-	mitm_interface();
+	static const char *pkt_class_names[PKT_CLASS_N] = {
+		"bulk", "tcp ctrl", "ack", "port", "dscp", "icmp", "non-ip"
+	};
+	static const char *inject_names[4] = {
+		"Inject direct", "Inject copied", "Send ip", "Send ether"
+	};
+	struct comm_stats *st = &stats.st;
+	struct clamp_stats *cl = &stats.cl;
+	size_t i, n = 0;
+
+#define LINE(...) do { \
+	if (n++ == line) { \
+		os_sprintf(buf, __VA_ARGS__); \
+		return true; \
+	} \
+} while (0)
 
+	LINE("HEAP free: %d, rx_err: %d, crc_err: %d, overruns: %d, "
+	     "dropped: %d", (int)stats.heap_free,
+	     (int)st->rx_errors, (int)st->rx_crc_errors,
+	     (int)st->rx_overruns, (int)st->dropped_packets);
+	LINE("Flow control stalls: rx (RTS): %d, tx (CTS): %d",
+	     (int)st->rx_rts_stalls, (int)st->tx_cts_stalls);
+	LINE("TX bytes: %d, fifo idle: %d",
+	     (int)st->tx_bytes, (int)st->tx_fifo_idle);
+	LINE("Seq gaps: %d, reorders: %d, retransmits: %d, missed: %d",
+	     (int)st->rx_seq_gaps, (int)st->rx_seq_reorders,
+	     (int)st->retransmits, (int)st->retransmit_misses);
+	for (i = 0; i < ARRAY_SIZE(st->tx_queues); i++) {
+		struct comm_tx_queue_stats *q = &st->tx_queues[i];
+		LINE("TX queue %d: frames: %d, dropped: %d, aqm: %d, "
+		     "discarded: %d, depth: %d", (int)i, (int)q->frames,
+		     (int)q->dropped, (int)q->aqm_dropped,
+		     (int)q->discarded, (int)q->depth);
+		LINE("TX queue %d latency us p50/p90/p99: %d/%d/%d", (int)i,
+		     (int)q->latency_p50, (int)q->latency_p90,
+		     (int)q->latency_p99);
+	}
+	for (i = 0; i < 3; i++) {
+		struct budget *b = i == 0 ? &st->tx_budget :
+		                   i == 1 ? &st->rx_budget :
+		                            &stats.inject_budget;
+		LINE("Budget %s used/peak/limit/denied: %d/%d/%d/%d",
+		     i == 0 ? "tx" : i == 1 ? "rx" : "inject",
+		     (int)b->used, (int)b->peak, (int)b->limit,
+		     (int)b->denied);
+	}
+	for (i = 0; i < 4; i++) {
+		struct inject_stats *is = i < 2 ? &stats.inject[i] :
+		                                  &stats.send[i - 2];
+		LINE("%s: packets: %d, cycles avg: %d, max: %d",
+		     inject_names[i], (int)is->n,
+		     is->n ? (int)(is->cycles / is->n) : 0,
+		     (int)is->cycles_max);
+	}
+	LINE("Inject queue drops: %d, no route: %d",
+	     (int)stats.inject_queue_drops, (int)stats.inject_no_route);
+	LINE("ACKs replaced: %d, superseded: %d, bytes saved: %d",
+	     (int)st->tx_acks_replaced, (int)st->tx_acks_dropped,
+	     (int)st->tx_ack_bytes_saved);
+	LINE("Max cycles with interrupts disabled: %d, in isr: %d; "
+	     "push avg: %d, max: %d",
+	     (int)st->intr_off_cycles_max, (int)st->isr_cycles_max,
+	     st->tx_push_n ? (int)(st->tx_push_cycles / st->tx_push_n) : 0,
+	     (int)st->tx_push_cycles_max);
+
+	LINE("Filter: %d insns, accepted: %d, truncated: %d, dropped: %d",
+	     (int)stats.fst.len, (int)stats.fst.accepted,
+	     (int)stats.fst.truncated, (int)stats.fst.dropped);
+	for (i = 0; i < stats_hits_lines(stats.fst.hits, stats.fst.len); i++) {
+		if (n++ == line) {
+			stats_hits_line(buf, "Filter ret", stats.fst.hits,
+			                stats.fst.len, i);
+			return true;
+		}
+	}
+
+	for (i = 0; i < PKT_CLASS_N; i += 2) {
+		struct classify_stats *c = &stats.cst;
+		if (i + 1 < PKT_CLASS_N)
+			LINE("Class %s: queued: %d, dropped: %d; "
+			     "%s: queued: %d, dropped: %d",
+			     pkt_class_names[i], (int)c->queued[i],
+			     (int)c->dropped[i], pkt_class_names[i + 1],
+			     (int)c->queued[i + 1], (int)c->dropped[i + 1]);
+		else
+			LINE("Class %s: queued: %d, dropped: %d",
+			     pkt_class_names[i], (int)c->queued[i],
+			     (int)c->dropped[i]);
+	}
+
+	LINE("Steering: %d rules", (int)stats.sst.len);
+	for (i = 0; i < stats_hits_lines(stats.sst.hits, stats.sst.len); i++) {
+		if (n++ == line) {
+			stats_hits_line(buf, "Steering rule", stats.sst.hits,
+			                stats.sst.len, i);
+			return true;
+		}
+	}
+
+	LINE("TCP window clamp: %d, clamped: %d, wscale removed: %d, "
+	     "skipped: %d", (int)cl->window, (int)cl->windows_clamped,
+	     (int)cl->ws_removed, (int)cl->skipped);
+	for (i = 0; i < CLAMP_IF_N; i++)
+		LINE("TCP MSS clamp %s: %d, clamped in: %d, out: %d",
+		     i == STATION_IF ? "station" : "softap",
+		     (int)cl->mss[i], (int)cl->mss_clamped_in[i],
+		     (int)cl->mss_clamped_out[i]);
+#undef LINE
+	return false;
+}
+
+static void ICACHE_FLASH_ATTR
+print_stats_continue(void *arg)
+{
+	unsigned char buf[PRINT_BUF_SIZE];
+
+	// line and another control message must fit
+	while (comm_tx_room(COMM_TX_PRIO_HIGH, 2, PRINT_BUF_SIZE)) {
+		buf[0] = 20; // level INFO
+		if (!stats_line(stats.line, buf + 1))
+			return;
+		stats.line++;
+		comm_send_ctl_id(stats.req_id, MSG_LOG, buf,
+		                 strlen(buf + 1) + 1);
+	}
+	os_timer_arm(&stats.timer, STATS_RETRY_MS, false);
+}
+
+// New request restarts the report with fresh counters
+static void ICACHE_FLASH_ATTR
+print_stats(void)
+{
+	if (comm_loglevel > 20)
+		return;
+
+	os_timer_disarm(&stats.timer);
+	comm_get_stats(&stats.st);
+	filter_get_stats(&stats.fst);
+	steering_get_stats(&stats.sst);
+	classify_get_stats(&stats.cst);
+	clamp_get_stats(&stats.cl);
+	stats.inject_budget = inject_budget;
+	stats.inject[0] = inject_direct_stats;
+	stats.inject[1] = inject_copy_stats;
+	stats.send[0] = inject_send_stats[0];
+	stats.send[1] = inject_send_stats[1];
+	stats.inject_queue_drops = inject_queue_drops;
+	stats.inject_no_route = inject_no_route;
+	stats.heap_free = system_get_free_heap_size();
+	stats.req_id = comm_req_id();
+	stats.line = 0;
+
+	os_timer_setfn(&stats.timer, print_stats_continue, NULL);
+	print_stats_continue(NULL);
+}
+
+static void ICACHE_FLASH_ATTR
+packet_from_host(uint8_t type, uint8_t *data, uint32_t n)
+{
 	switch(type) {
 	case MSG_IP_PACKET:
 		COMM_DBG("Packet from host, %d bytes", n);
 		if (global_forwarding_mode == FORWARDING_MODE_IP)
-			inject_ip_packet(data, n);
+			inject_packet(type, data, n);
 		else
 			COMM_ERR("Cannot forward IP packet in mode %d",
 				 (int) global_forwarding_mode);
 		break;
 	case MSG_ETHER_PACKET:
 		if (global_forwarding_mode == FORWARDING_MODE_ETHER)
-			inject_ether_packet(data, n);
+			inject_packet(type, data, n);
 		else
 			COMM_ERR("Cannot forward Ether packet in mode %d",
 				 (int) global_forwarding_mode);
@@ -572,6 +1205,7 @@ packet_from_host(uint8_t type, uint8_t *data, uint32_t n)
 		config.channel = r->channel;
 		config.show_hidden = r->show_hidden;
 
+		scan_req_id = comm_req_id();
 		TRY(!wifi_station_scan(&config, scan_done), "Scan request failed");
 
 		comm_send_status(0);
@@ -618,6 +1252,57 @@ packet_from_host(uint8_t type, uint8_t *data, uint32_t n)
 		comm_send_status(0);
 		break;
 	}
+	case MSG_FORWARD_ICMP_TYPES: {
+		TRY(n != sizeof(forward_icmp_types),
+		    "Wrong size of Forward ICMP Types payload: %d", n);
+		os_memcpy(&forward_icmp_types, data, sizeof(forward_icmp_types));
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_FILTER: {
+		TRY(n % sizeof(struct filter_insn),
+		    "Wrong size of Set Filter payload: %d", n);
+		TRY(!filter_set((void *)data, n / sizeof(struct filter_insn)),
+		    "Filter rejected");
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_STEERING: {
+		TRY(n % sizeof(struct msg_steer_rule),
+		    "Wrong size of Set Steering payload: %d", n);
+		TRY(!steering_set((void *)data,
+		                  n / sizeof(struct msg_steer_rule)),
+		    "Steering table rejected");
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_PRIO_PORTS: {
+		TRY(n % sizeof(struct msg_prio_port),
+		    "Wrong size of Set Prio Ports payload: %d", n);
+		TRY(!classify_set_ports((void *)data,
+		                        n / sizeof(struct msg_prio_port)),
+		    "Port rules rejected");
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_TCP_WINDOW_CLAMP: {
+		uint32_t rtt;
+		TRY(n != sizeof(rtt),
+		    "Wrong size of Set TCP Window Clamp payload: %d", n);
+		os_memcpy(&rtt, data, sizeof(rtt));
+		TRY(!clamp_set_window_rtt(rtt), "Window clamp rejected");
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_TCP_MSS_CLAMP: {
+		struct msg_tcp_mss_clamp *conf = (void *)data;
+		TRY(n != sizeof(*conf),
+		    "Wrong size of Set TCP MSS Clamp payload: %d", n);
+		TRY(!clamp_set_mss(conf->interface, conf->mss),
+		    "MSS clamp rejected");
+		comm_send_status(0);
+		break;
+	}
 	case MSG_SET_FORWARDING_MODE: {
 		TRY(n != 1, "Wrong size of Set Forwarding Mode payload: %d", n);
 		global_forwarding_mode = data[0];
@@ -702,26 +1387,75 @@ packet_from_host(uint8_t type, uint8_t *data, uint32_t n)
 		comm_send_status(0);
 		break;
 	}
+	case MSG_SET_FLOW_CONTROL: {
+		TRY(n != 1, "Wrong size of Set Flow Control payload: %d", n);
+		TRY(data[0] > FLOW_CONTROL_RTS_CTS,
+		    "Unknown flow control mode %d", (int)data[0]);
+		comm_send_status(0);
+		comm_set_flow_control(data[0]);
+		break;
+	}
+	case MSG_SET_FRAMING: {
+		TRY(n != 1, "Wrong size of Set Framing payload: %d", n);
+		TRY(data[0] & ~(FRAMING_SEQ | FRAMING_REQ_ID | FRAMING_BATCH |
+		                FRAMING_RX_CREDIT),
+		    "Unknown framing flags %x", (int)data[0]);
+		comm_send_status(0);
+		comm_set_framing(data[0]);
+		break;
+	}
+	case MSG_NACK: {
+		uint32_t i;
+		for (i = 0; i < n; i++) {
+			if (!comm_retransmit(data[i]))
+				COMM_WARN("Can't retransmit frame %d",
+				          (int)data[i]);
+		}
+		break;
+	}
+	case MSG_SET_TX_AQM: {
+		struct msg_tx_aqm_conf *conf = (void *) data;
+		TRY(n != sizeof(*conf),
+		    "Wrong size of Set TX AQM payload: %d", n);
+		TRY(!comm_set_tx_aqm(conf->prio, conf->target, conf->interval),
+		    "Invalid TX AQM settings");
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_TX_THRESHOLD: {
+		TRY(n != 1, "Wrong size of Set TX Threshold payload: %d", n);
+		TRY(!comm_set_tx_threshold(data[0]),
+		    "Invalid TX threshold %d", (int)data[0]);
+		comm_send_status(0);
+		break;
+	}
+	case MSG_SET_TX_QUEUE: {
+		struct msg_tx_queue_conf *conf = (void *) data;
+		TRY(n != sizeof(*conf),
+		    "Wrong size of Set TX Queue payload: %d", n);
+		TRY(!comm_set_tx_queue(conf->prio, conf->max_frames,
+		                       conf->max_bytes, conf->weight),
+		    "Invalid TX queue settings");
+		comm_send_status(0);
+		break;
+	}
 	case MSG_LOG_LEVEL_SET: {
 		TRY(n != 1, "Wrong size of Set Loglevel payload: %d", n);
 		comm_set_loglevel(data[0]);
 		comm_send_status(0);
 		break;
 	}
-	case MSG_PRINT_STATS: {
-		uint32_t rx_errors, crc_errors, dropped_packets;
-		comm_get_stats(&rx_errors, &crc_errors, &dropped_packets);
-		COMM_INFO("HEAP free: %d, rx_err: %d, crc_err: %d, dropped: %d",
-		          system_get_free_heap_size(),
-		          (int)rx_errors, (int)crc_errors, (int)dropped_packets);
+	case MSG_PRINT_STATS:
+		print_stats();
 		break;
-	}
 	case MSG_ECHO_REQUEST:
 		comm_send_ctl(MSG_ECHO_REPLY, data, n);
 		break;
 	case MSG_SET_BAUD: {
 		uint32_t *baud = (void *) data;
 		uart_div_modify(0, UART_CLK_FREQ / (*baud));
+		// 8N1, start and stop bits included
+		clamp_set_drain_rate(*baud / 10);
 		break;
 	}
 	default:;
@@ -741,7 +1475,12 @@ user_init(void)
 	os_delay_us(50*1000);   // delay 50ms before init uart
 
 	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+	budget_init(&inject_budget, INJECT_BUDGET);
+	steering_init();
 	comm_init(packet_from_host);
+	comm_set_rx_alloc(&rx_pbuf_ops);
+	system_os_task(inject_task, INJECT_TASK_PRIO, inject_task_queue,
+	               ARRAY_SIZE(inject_task_queue));
 
 	comm_send_ctl(MSG_BOOT, NULL, 0);
 
@@ -765,4 +1504,9 @@ user_init(void)
 
 	/* task_init(); */
 	init_wlan();
+
+	/* Interfaces restored from flash config may already be up */
+	wifi_set_event_handler_cb(wifi_event_cb);
+	hook_netif(STATION_IF);
+	hook_netif(SOFTAP_IF);
 }